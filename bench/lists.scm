@@ -0,0 +1,15 @@
+(define iota
+  (lambda (n list)
+    (if (= n 0) list (iota (- n 1) (cons n list)))))
+(define sum
+  (lambda (list total)
+    (if list (sum (cdr list) (+ total (car list))) total)))
+(define reverse
+  (lambda (list reversed)
+    (if list (reverse (cdr list) (cons (car list) reversed)) reversed)))
+(define repeat
+  (lambda (i total)
+    (if (= i 0)
+        total
+        (repeat (- i 1) (+ total (sum (reverse (iota 100000 ()) ()) 0))))))
+(repeat 10 0)
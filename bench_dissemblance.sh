@@ -0,0 +1,166 @@
+#!/bin/sh
+
+# Runs each program in bench/ on both engines, and with its lambdas compiled
+# ahead of time if there is an interpreter with them built in, in aot/ beside
+# the interpreter, as `make bench` builds.  Compares the fastest of several
+# runs, the objects allocated and the peak RSS with bench/baseline.json.
+# Exits with failure if any of them regressed.
+#
+#     ./bench_dissemblance.sh [--save] [bin/release/dissemblance]
+#
+# With --save, or if there is no baseline yet, writes the results to the
+# baseline instead.  Timings on a noisy machine may need a looser
+# BENCH_TOLERANCE than the default, which allows 30% slower.
+
+SAVE=''
+if [ "$1" = --save ]; then
+    SAVE=1
+    shift
+fi
+DISSEMBLANCE="${1:-bin/release/dissemblance}"
+BASELINE=bench/baseline.json
+RUNS=5
+TOLERANCE="${BENCH_TOLERANCE:-1.3}"
+
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+
+# A large literal, so that most of the time goes to the parser.
+awk 'BEGIN {
+    printf("(car (cdr (quote (");
+    for (i = 0; i < 200000; i++) {
+        printf("%d (symbol-%d %d.5 (nested (list))) ", i, i % 100, i);
+    }
+    print("))))");
+}' > "$WORK/parse.scm"
+
+# A join of 2000 symbols against a table of them, by hash table and by assoc
+# list.  The AOT build knows only the programs in bench/, so these are made
+# here.
+awk 'BEGIN {
+    printf("(define keys (quote (");
+    for (i = 0; i < 2000; i++) {
+        printf("key-%d ", (i * 7919) % 2000);
+    }
+    print(")))");
+}' > "$WORK/keys.scm"
+cat "$WORK/keys.scm" - > "$WORK/join-hash.scm" << 'EOF'
+(define table (make-hash-table))
+(define index (lambda (ks i) (if ks (begin (hash-set! table (car ks) i) (index (cdr ks) (+ i 1))) i)))
+(index keys 0)
+(define join (lambda (ks sum) (if ks (join (cdr ks) (+ sum (hash-ref table (car ks)))) sum)))
+(join keys 0)
+EOF
+cat "$WORK/keys.scm" - > "$WORK/join-assoc.scm" << 'EOF'
+(define index (lambda (ks i table) (if ks (index (cdr ks) (+ i 1) (cons (cons (car ks) i) table)) table)))
+(define table (index keys 0 ()))
+(define lookup (lambda (k l) (if (eq? k (car (car l))) (cdr (car l)) (lookup k (cdr l)))))
+(define join (lambda (ks sum) (if ks (join (cdr ks) (+ sum (lookup (car ks) table))) sum)))
+(join keys 0)
+EOF
+
+now() {
+    date +%s%N
+}
+
+bench() {
+    NAME="$1"
+    PROGRAM="$2"
+    ENGINE="$3"
+    BINARY="${4:-$DISSEMBLANCE}"
+    BEST=''
+    for RUN in $(seq $RUNS); do
+        START=$(now)
+        if ! "$BINARY" $ENGINE --alloc-stats "$PROGRAM" > /dev/null 2> "$WORK/stats"; then
+            echo "$NAME failed" >&2
+            exit 1
+        fi
+        NS=$(( $(now) - START ))
+        if [ -z "$BEST" ] || [ $NS -lt $BEST ]; then
+            BEST=$NS
+        fi
+    done
+    TIME=$(echo $BEST | awk '{ printf "%.4f", $1 / 1e9 }')
+    ALLOCATIONS=$(sed -n 's/^allocations: //p' "$WORK/stats")
+    RSS=$(sed -n 's/^peak RSS: \([0-9]*\) KB$/\1/p' "$WORK/stats")
+    printf '  "%s": {"seconds": %s, "allocations": %s, "peak_rss_kb": %s},\n' \
+           "$NAME" $TIME $ALLOCATIONS $RSS >> "$WORK/results"
+}
+
+for PROGRAM in bench/*.scm "$WORK/parse.scm" "$WORK/join-hash.scm" "$WORK/join-assoc.scm"; do
+    NAME="$(basename "$PROGRAM" .scm)"
+    AOT="$(dirname "$DISSEMBLANCE")/aot/$NAME"
+    bench "$NAME" "$PROGRAM" ''
+    bench "$NAME/vm" "$PROGRAM" --vm
+    if [ -x "$AOT" ]; then
+        # Its lambdas are already defined, so only the rest of the program.
+        awk '/^\(/ { keep = !/^\(define/ } keep' "$PROGRAM" > "$WORK/calls.scm"
+        bench "$(basename "$PROGRAM" .scm)/aot" "$WORK/calls.scm" '' "$AOT"
+    fi
+done
+
+# The same, with its parse cached by the runs before the fastest.
+export DISSEMBLANCE_CACHE="$WORK/cache"
+bench parse/cached "$WORK/parse.scm" ''
+unset DISSEMBLANCE_CACHE
+
+# The same, with its repeated sublists shared.
+bench parse/hash-cons "$WORK/parse.scm" --hash-cons
+
+(echo '{'; sed '$ s/,$//' "$WORK/results"; echo '}') > "$WORK/results.json"
+
+if [ "$SAVE" ] || ! [ -f "$BASELINE" ]; then
+    cp "$WORK/results.json" "$BASELINE"
+    cat "$BASELINE"
+    exit 0
+fi
+
+# Slower or larger beyond the tolerance, or allocating more at all, is a
+# regression.
+awk -v tolerance="$TOLERANCE" '
+    function field(line, key) {
+        match(line, "\"" key "\": [0-9.]+");
+        return substr(line, RSTART + length(key) + 4, RLENGTH - length(key) - 4) + 0;
+    }
+    /"seconds"/ {
+        match($0, /"[^"]+"/);
+        name = substr($0, RSTART + 1, RLENGTH - 2);
+        if (FILENAME == ARGV[1]) {
+            baseline[name] = $0;
+            next;
+        }
+        seconds = field($0, "seconds");
+        allocations = field($0, "allocations");
+        rss = field($0, "peak_rss_kb");
+        if (!(name in baseline)) {
+            printf "%-16s %8.4fs %10d allocations %7d KB   (new)\n", name, seconds, allocations, rss;
+            next;
+        }
+        old = baseline[name];
+        oldSeconds = field(old, "seconds");
+        oldAllocations = field(old, "allocations");
+        oldRss = field(old, "peak_rss_kb");
+        status = "";
+        if (seconds > oldSeconds * tolerance && seconds - oldSeconds > 0.01) {
+            status = status " SLOWER";
+        }
+        if (allocations > oldAllocations) {
+            status = status " MORE-ALLOCATIONS";
+        }
+        if (rss > oldRss * tolerance && rss - oldRss > 1024) {
+            status = status " MORE-MEMORY";
+        }
+        if (status != "") {
+            regressed = 1;
+        }
+        printf "%-16s %8.4fs (%8.4fs) %10d allocations (%10d) %7d KB (%7d)%s\n",
+               name, seconds, oldSeconds, allocations, oldAllocations, rss, oldRss, status;
+    }
+    END {
+        if (regressed) {
+            print "REGRESSED";
+            exit 1;
+        }
+        print "good";
+    }
+' "$BASELINE" "$WORK/results.json"
@@ -0,0 +1,38 @@
+// Compiled by dissemblance-aot from bench/ackermann.scm.  Do not edit.
+
+#include "aot.h"
+
+using namespace dissemblance;
+
+namespace {
+
+Value f0_ack(Value v0_m, Value v1_n);
+
+// ack
+Value f0_ack(Value v0_m, Value v1_n) {
+    while (true) {
+        safe_point();
+        if (aot::equal(v0_m, Value::Integer(0))) {
+            return aot::add(v1_n, Value::Integer(1));
+        } else {
+            if (aot::equal(v1_n, Value::Integer(0))) {
+                Value next0 = aot::subtract(v0_m, Value::Integer(1));
+                Value next1 = Value::Integer(1);
+                v0_m = std::move(next0);
+                v1_n = std::move(next1);
+                continue;
+            } else {
+                Value next0 = aot::subtract(v0_m, Value::Integer(1));
+                Value next1 = f0_ack(v0_m, aot::subtract(v1_n, Value::Integer(1)));
+                v0_m = std::move(next0);
+                v1_n = std::move(next1);
+                continue;
+            }
+        }
+    }
+}
+
+const bool registered =
+        aot::define("ack", 2, [](const Value* args) { return f0_ack(args[0], args[1]); });
+
+}  // namespace
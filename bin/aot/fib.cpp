@@ -0,0 +1,24 @@
+// Compiled by dissemblance-aot from bench/fib.scm.  Do not edit.
+
+#include "aot.h"
+
+using namespace dissemblance;
+
+namespace {
+
+Value f0_fib(Value v0_n);
+
+// fib
+Value f0_fib(Value v0_n) {
+    safe_point();
+    if (aot::less(v0_n, Value::Integer(2))) {
+        return v0_n;
+    } else {
+        return aot::add(f0_fib(aot::subtract(v0_n, Value::Integer(1))), f0_fib(aot::subtract(v0_n, Value::Integer(2))));
+    }
+}
+
+const bool registered =
+        aot::define("fib", 1, [](const Value* args) { return f0_fib(args[0]); });
+
+}  // namespace
@@ -0,0 +1,84 @@
+// Compiled by dissemblance-aot from bench/lists.scm.  Do not edit.
+
+#include "aot.h"
+
+using namespace dissemblance;
+
+namespace {
+
+Value f0_iota(Value v0_n, Value v1_list);
+Value f1_sum(Value v0_list, Value v1_total);
+Value f2_reverse(Value v0_list, Value v1_reversed);
+Value f3_repeat(Value v0_i, Value v1_total);
+
+// iota
+Value f0_iota(Value v0_n, Value v1_list) {
+    while (true) {
+        safe_point();
+        if (aot::equal(v0_n, Value::Integer(0))) {
+            return v1_list;
+        } else {
+            Value next0 = aot::subtract(v0_n, Value::Integer(1));
+            Value next1 = aot::cons(v0_n, v1_list);
+            v0_n = std::move(next0);
+            v1_list = std::move(next1);
+            continue;
+        }
+    }
+}
+
+// sum
+Value f1_sum(Value v0_list, Value v1_total) {
+    while (true) {
+        safe_point();
+        if (bool(v0_list)) {
+            Value next0 = aot::cdr(v0_list);
+            Value next1 = aot::add(v1_total, aot::car(v0_list));
+            v0_list = std::move(next0);
+            v1_total = std::move(next1);
+            continue;
+        } else {
+            return v1_total;
+        }
+    }
+}
+
+// reverse
+Value f2_reverse(Value v0_list, Value v1_reversed) {
+    while (true) {
+        safe_point();
+        if (bool(v0_list)) {
+            Value next0 = aot::cdr(v0_list);
+            Value next1 = aot::cons(aot::car(v0_list), v1_reversed);
+            v0_list = std::move(next0);
+            v1_reversed = std::move(next1);
+            continue;
+        } else {
+            return v1_reversed;
+        }
+    }
+}
+
+// repeat
+Value f3_repeat(Value v0_i, Value v1_total) {
+    while (true) {
+        safe_point();
+        if (aot::equal(v0_i, Value::Integer(0))) {
+            return v1_total;
+        } else {
+            Value next0 = aot::subtract(v0_i, Value::Integer(1));
+            Value next1 = aot::add(v1_total, f1_sum(f2_reverse(f0_iota(Value::Integer(100000), Value()), Value()), Value::Integer(0)));
+            v0_i = std::move(next0);
+            v1_total = std::move(next1);
+            continue;
+        }
+    }
+}
+
+const bool registered =
+        aot::define("iota", 2, [](const Value* args) { return f0_iota(args[0], args[1]); }) &&
+        aot::define("sum", 2, [](const Value* args) { return f1_sum(args[0], args[1]); }) &&
+        aot::define("reverse", 2, [](const Value* args) { return f2_reverse(args[0], args[1]); }) &&
+        aot::define("repeat", 2, [](const Value* args) { return f3_repeat(args[0], args[1]); });
+
+}  // namespace
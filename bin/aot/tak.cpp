@@ -0,0 +1,32 @@
+// Compiled by dissemblance-aot from bench/tak.scm.  Do not edit.
+
+#include "aot.h"
+
+using namespace dissemblance;
+
+namespace {
+
+Value f0_tak(Value v0_x, Value v1_y, Value v2_z);
+
+// tak
+Value f0_tak(Value v0_x, Value v1_y, Value v2_z) {
+    while (true) {
+        safe_point();
+        if (aot::less(v1_y, v0_x)) {
+            Value next0 = f0_tak(aot::subtract(v0_x, Value::Integer(1)), v1_y, v2_z);
+            Value next1 = f0_tak(aot::subtract(v1_y, Value::Integer(1)), v2_z, v0_x);
+            Value next2 = f0_tak(aot::subtract(v2_z, Value::Integer(1)), v0_x, v1_y);
+            v0_x = std::move(next0);
+            v1_y = std::move(next1);
+            v2_z = std::move(next2);
+            continue;
+        } else {
+            return v2_z;
+        }
+    }
+}
+
+const bool registered =
+        aot::define("tak", 3, [](const Value* args) { return f0_tak(args[0], args[1], args[2]); });
+
+}  // namespace
@@ -0,0 +1,407 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// dissemblance-aot: compiles a library of lambdas to C++.
+//
+//     bin/dissemblance-aot library.scm > library.cpp
+//
+// Each top-level (define name (lambda (parameter...) body...)) becomes a C++
+// function, which, once linked into the interpreter, CoreEnvironemnt() binds
+// to `name`, so interpreted code calls it as it would any builtin.  Other
+// top-level forms, such as calls that run the library, are left out.
+//
+// A body may use its parameters, numbers, (), `if`, `begin`, + - * = != < >
+// <= >=, cons car cdr, and calls of the library's own lambdas, which call the
+// C++ functions directly.  A call of a lambda of itself in tail position is
+// a loop; other calls use the C++ stack.  Anything else is an error, since
+// the point is code that runs without the interpreter.
+
+#include "dissemblance.h"
+#include "expression.h"
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+
+using namespace dissemblance;
+
+namespace {
+
+struct Function {
+    const Symbol* name;
+    std::vector<const Symbol*> parameters;
+    Value body;  // a list of expressions.
+    std::string cName;
+    std::vector<std::string> cParameters;
+};
+
+// Letters and digits are kept, so that the C++ reads like the Scheme.
+std::string identifier(const char* prefix, size_t index, const std::string& name) {
+    std::string result = prefix + std::to_string(index) + '_';
+    for (char c : name) {
+        result += isalnum((unsigned char)c) ? c : '_';
+    }
+    return result;
+}
+
+std::string serialize(const Value& value) {
+    std::ostringstream o;
+    Expression::Serialize(value, &o);
+    return o.str();
+}
+
+class Compiler {
+    std::vector<Function> functions;
+    std::unordered_map<const Symbol*, size_t> functionIndex;
+    const Function* function = nullptr;  // being compiled.
+    bool selfTailCall = false;
+    std::string error;
+
+    void fail(const std::string& message, const Value& expr) {
+        if (error.empty()) {
+            error = message + ": " + serialize(expr);
+        }
+    }
+
+    // Returns the symbol at the head of a call, if there is one.
+    static const Symbol* head(const Value& expr) {
+        const Cons* cons = dcastCons(expr);
+        return cons ? dcastSymbol(cons->left) : nullptr;
+    }
+
+    const std::string* parameter(const Symbol* symbol) const {
+        for (size_t i = 0; i < function->parameters.size(); ++i) {
+            if (function->parameters[i] == symbol) {
+                return &function->cParameters[i];
+            }
+        }
+        return nullptr;
+    }
+
+    std::string number(const Value& expr) {
+        Number n = to_number(expr);
+        char buffer[64];
+        if (n.isInt()) {
+            if (Value::FitsInteger(n.asInt())) {
+                snprintf(buffer, sizeof(buffer), "Value::Integer(%" PRId64 ")", n.asInt());
+            } else {
+                snprintf(buffer, sizeof(buffer), "make_number(Number((int64_t)%" PRIu64 "ull))",
+                         (uint64_t)n.asInt());
+            }
+        } else if (std::isnan(n.asDouble())) {
+            return "Value::Double(NAN)";
+        } else if (std::isinf(n.asDouble())) {
+            return n.asDouble() > 0 ? "Value::Double(HUGE_VAL)" : "Value::Double(-HUGE_VAL)";
+        } else {
+            snprintf(buffer, sizeof(buffer), "Value::Double(%a)", n.asDouble());
+        }
+        return buffer;
+    }
+
+    std::vector<std::string> operands(const Value& expr) {
+        std::vector<std::string> result;
+        const Cons* cons = dcastCons(expr);
+        for (const Cons* c = dcastCons(cons->right); c; c = dcastCons(c->right)) {
+            result.push_back(this->expression(c->left));
+        }
+        return result;
+    }
+
+    static std::string join(const std::vector<std::string>& list) {
+        std::string result;
+        for (const std::string& s : list) {
+            result += (result.empty() ? "" : ", ") + s;
+        }
+        return result;
+    }
+
+    // A comparison, as a C++ bool, or "" if `expr` is not one.
+    std::string comparison(const Value& expr) {
+        static const std::pair<const char*, const char*> kComparisons[] = {
+            {"=", "equal"}, {"!=", "not_equal"}, {"<", "less"},
+            {">", "greater"}, {"<=", "less_eq"}, {">=", "greater_eq"},
+        };
+        const Symbol* symbol = head(expr);
+        if (!symbol || this->parameter(symbol) || functionIndex.count(symbol)) {
+            return "";
+        }
+        for (const auto& c : kComparisons) {
+            if (symbol->name == c.first) {
+                auto args = this->operands(expr);
+                if (args.size() != 2) {
+                    this->fail("comparisons take two arguments", expr);
+                }
+                return std::string("aot::") + c.second + "(" + join(args) + ")";
+            }
+        }
+        return "";
+    }
+
+    std::string condition(const Value& expr) {
+        std::string result = this->comparison(expr);
+        return result.empty() ? "bool(" + this->expression(expr) + ")" : result;
+    }
+
+    // (+ a b c) as add(add(a, b), c).
+    std::string fold(const char* op, const char* identity, std::vector<std::string> args) {
+        if (args.empty()) {
+            return identity;
+        }
+        std::string result = args.size() == 1
+                ? std::string("aot::") + op + "(" + identity + ", " + args[0] + ")"
+                : args[0];
+        for (size_t i = 1; i < args.size(); ++i) {
+            result = std::string("aot::") + op + "(" + result + ", " + args[i] + ")";
+        }
+        return result;
+    }
+
+    std::string expression(const Value& expr) {
+        if (!expr) {
+            return "Value()";
+        }
+        if (is_number(expr)) {
+            return this->number(expr);
+        }
+        if (const Symbol* symbol = dcastSymbol(expr)) {
+            if (const std::string* name = this->parameter(symbol)) {
+                return *name;
+            }
+            this->fail("not a parameter", expr);
+            return "";
+        }
+        const Cons* cons = dcastCons(expr);
+        const Symbol* symbol = head(expr);
+        const Procedure* proc = cons ? dcastProcedure(cons->left) : nullptr;
+        if ((proc && proc->form() == Procedure::QuoteForm) ||
+            (symbol && symbol->name == "quote" && !this->parameter(symbol))) {
+            // 'x, which the parser reads as (#<quote> x), or (quote x).
+            const Value& quoted = 1 == length(cons->right) ? get_item(cons->right, 0) : expr;
+            if (dcastCons(quoted) || dcastSymbol(quoted)) {
+                this->fail("can only quote () and numbers", expr);
+                return "";
+            }
+            return this->expression(quoted);
+        }
+        if (!cons || !symbol || this->parameter(symbol)) {
+            this->fail("can not compile", expr);
+            return "";
+        }
+        std::string compared = this->comparison(expr);
+        if (!compared.empty()) {
+            return "aot::truth(" + compared + ")";
+        }
+        auto found = functionIndex.find(symbol);
+        if (found != functionIndex.end()) {
+            const Function& callee = functions[found->second];
+            auto args = this->operands(expr);
+            if (args.size() != callee.parameters.size()) {
+                this->fail("wrong number of arguments", expr);
+            }
+            return callee.cName + "(" + join(args) + ")";
+        }
+        const std::string& name = symbol->name;
+        int count = length(cons->right);
+        if (name == "if") {
+            if (3 != count) {
+                this->fail("`if` takes three operands", expr);
+                return "";
+            }
+            return "(" + this->condition(get_item(cons->right, 0)) + " ? " +
+                   this->expression(get_item(cons->right, 1)) + " : " +
+                   this->expression(get_item(cons->right, 2)) + ")";
+        }
+        if (name == "begin" && count > 0) {
+            auto args = this->operands(expr);
+            std::string result = "(";
+            for (size_t i = 0; i + 1 < args.size(); ++i) {
+                result += "(void)" + args[i] + ", ";
+            }
+            return result + args.back() + ")";
+        }
+        if (name == "+") {
+            return this->fold("add", "Value::Integer(0)", this->operands(expr));
+        }
+        if (name == "*") {
+            return this->fold("multiply", "Value::Integer(1)", this->operands(expr));
+        }
+        if (name == "-" && 1 == count) {
+            return "aot::negate(" + join(this->operands(expr)) + ")";
+        }
+        if (name == "-" && 2 == count) {
+            return "aot::subtract(" + join(this->operands(expr)) + ")";
+        }
+        if ((name == "car" || name == "cdr") && 1 == count) {
+            return "aot::" + name + "(" + join(this->operands(expr)) + ")";
+        }
+        if (name == "cons" && 2 == count) {
+            return "aot::cons(" + join(this->operands(expr)) + ")";
+        }
+        this->fail("can not compile", expr);
+        return "";
+    }
+
+    // Statements that return the value of `expr`.
+    void tail(const Value& expr, const std::string& indent, std::string* out) {
+        const Symbol* symbol = head(expr);
+        bool local = symbol && (this->parameter(symbol) || functionIndex.count(symbol));
+        if (symbol == function->name && !this->parameter(symbol)) {
+            // A loop: the new arguments, all evaluated before any is assigned.
+            auto args = this->operands(expr);
+            if (args.size() != function->parameters.size()) {
+                this->fail("wrong number of arguments", expr);
+                return;
+            }
+            for (size_t i = 0; i < args.size(); ++i) {
+                *out += indent + "Value next" + std::to_string(i) + " = " + args[i] + ";\n";
+            }
+            for (size_t i = 0; i < args.size(); ++i) {
+                *out += indent + function->cParameters[i] +
+                        " = std::move(next" + std::to_string(i) + ");\n";
+            }
+            *out += indent + "continue;\n";
+            selfTailCall = true;
+        } else if (symbol && !local && symbol->name == "if" && 3 == length(dcastCons(expr)->right)) {
+            const Value& operands = dcastCons(expr)->right;
+            *out += indent + "if (" + this->condition(get_item(operands, 0)) + ") {\n";
+            this->tail(get_item(operands, 1), indent + "    ", out);
+            *out += indent + "} else {\n";
+            this->tail(get_item(operands, 2), indent + "    ", out);
+            *out += indent + "}\n";
+        } else if (symbol && !local && symbol->name == "begin" && dcastCons(expr)->right) {
+            this->sequence(dcastCons(expr)->right, indent, out);
+        } else {
+            *out += indent + "return " + this->expression(expr) + ";\n";
+        }
+    }
+
+    void sequence(const Value& body, const std::string& indent, std::string* out) {
+        const Cons* cons = dcastCons(body);
+        while (const Cons* next = dcastCons(cons->right)) {
+            *out += indent + "(void)" + this->expression(cons->left) + ";\n";
+            cons = next;
+        }
+        this->tail(cons->left, indent, out);
+    }
+
+public:
+    // Adds a top-level form, returning false if it is a define this can not
+    // compile.
+    bool declare(const Value& form) {
+        const Symbol* symbol = head(form);
+        if (!symbol || symbol->name != "define") {
+            return true;
+        }
+        const Value& operands = dcastCons(form)->right;
+        bool pair = 2 == length(operands);
+        const Value& lambda = pair ? get_item(operands, 1) : form;
+        const Symbol* name = pair ? dcastSymbol(get_item(operands, 0)) : nullptr;
+        if (!name || !head(lambda) ||
+            head(lambda)->name != "lambda" || length(dcastCons(lambda)->right) < 2) {
+            this->fail("can only compile (define name (lambda parameters body...))", form);
+            return false;
+        }
+        Function f;
+        f.name = name;
+        f.cName = identifier("f", functions.size(), name->name);
+        const Cons* rest = dcastCons(dcastCons(lambda)->right);
+        for (const Value* p = &rest->left; *p; p = &dcastCons(*p)->right) {
+            const Cons* cons = dcastCons(*p);
+            const Symbol* parameter = cons ? dcastSymbol(cons->left) : nullptr;
+            if (!parameter) {
+                this->fail("can only compile a list of parameters", rest->left);
+                return false;
+            }
+            f.cParameters.push_back(identifier("v", f.parameters.size(), parameter->name));
+            f.parameters.push_back(parameter);
+        }
+        f.body = rest->right;
+        if (!functionIndex.emplace(name, functions.size()).second) {
+            this->fail("defined twice", Value(name));
+            return false;
+        }
+        functions.push_back(std::move(f));
+        return true;
+    }
+
+    // The C++ for every function declared, or "" with error() set.
+    std::string compile(const char* source) {
+        std::string out = std::string("// Compiled by dissemblance-aot from ") + source +
+                          ".  Do not edit.\n\n#include \"aot.h\"\n\n"
+                          "using namespace dissemblance;\n\nnamespace {\n\n";
+        auto signature = [](const Function& f) {
+            std::string result = "Value " + f.cName + "(";
+            for (size_t i = 0; i < f.cParameters.size(); ++i) {
+                result += (i ? ", Value " : "Value ") + f.cParameters[i];
+            }
+            return result + ")";
+        };
+        for (const Function& f : functions) {
+            out += signature(f) + ";\n";
+        }
+        for (const Function& f : functions) {
+            function = &f;
+            selfTailCall = false;
+            std::string body;
+            this->sequence(f.body, "        ", &body);
+            out += "\n// " + f.name->name + "\n" + signature(f) + " {\n";
+            if (selfTailCall) {
+                out += "    while (true) {\n        safe_point();\n" + body + "    }\n";
+            } else {
+                body.clear();
+                this->sequence(f.body, "    ", &body);
+                out += "    safe_point();\n" + body;
+            }
+            out += "}\n";
+        }
+        out += "\nconst bool registered =";
+        for (const Function& f : functions) {
+            std::string args;
+            for (size_t i = 0; i < f.parameters.size(); ++i) {
+                args += (i ? ", args[" : "args[") + std::to_string(i) + "]";
+            }
+            out += (&f == &functions.front() ? "\n        " : " &&\n        ");
+            out += "aot::define(\"" + f.name->name + "\", " + std::to_string(f.parameters.size()) +
+                   ", [](const Value* args) { return " + f.cName + "(" + args + "); })";
+        }
+        out += (functions.empty() ? " true;\n" : ";\n");
+        out += "\n}  // namespace\n";
+        return error.empty() ? out : "";
+    }
+
+    const std::string& message() const { return error; }
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::cerr << "usage: " << argv[0] << " library.scm > library.cpp\n";
+        return 1;
+    }
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file) {
+        perror(argv[1]);
+        return 1;
+    }
+    std::ostringstream text;
+    text << file.rdbuf();
+    std::string source = text.str();
+    Compiler compiler;
+    for (const Value& form : ParseAll(source)) {
+        if (!compiler.declare(form)) {
+            break;
+        }
+    }
+    std::string output = compiler.message().empty() ? compiler.compile(argv[1]) : "";
+    if (output.empty()) {
+        std::cerr << argv[1] << ": " << compiler.message() << '\n';
+        return 1;
+    }
+    std::cout << output;
+    return 0;
+}
@@ -0,0 +1,84 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// What the C++ that dissemblance-aot writes calls into: the builtins it
+// compiles calls of, with the same results as those in dissemblance.cpp, and
+// the registration of its functions as procedures.
+
+#ifndef aot_DEFINED
+#define aot_DEFINED
+
+#include "expression.h"
+
+#include <cmath>
+
+namespace dissemblance {
+namespace aot {
+
+// Binds `name` to a procedure calling `function` with `arity` arguments, in
+// every environment CoreEnvironemnt() makes.  Call before main(); returns
+// true, so that it can initialize a static.
+bool define(const char* name, int arity, Value (*function)(const Value* args));
+
+inline Value truth(bool b) {
+    return b ? Value::Integer(1) : nullptr;
+}
+
+inline Value add(const Value& u, const Value& v) {
+    if (u.isInteger() && v.isInteger()) {
+        // Immediate integers are too small to overflow.
+        return make_number(Number(u.asInteger() + v.asInteger()));
+    }
+    return make_number(to_number(u) + to_number(v));
+}
+
+inline Value subtract(const Value& u, const Value& v) {
+    if (u.isInteger() && v.isInteger()) {
+        return make_number(Number(u.asInteger() - v.asInteger()));
+    }
+    return make_number(to_number(u) - to_number(v));
+}
+
+inline Value negate(const Value& u) {
+    return make_number(Number(0) - to_number(u));
+}
+
+inline Value multiply(const Value& u, const Value& v) {
+    return make_number(to_number(u) * to_number(v));
+}
+
+#define DISSEMBLANCE_AOT_COMPARISON(NAME, OPERATOR)                  \
+    inline bool NAME(const Value& u, const Value& v) {               \
+        if (u.isInteger() && v.isInteger()) {                        \
+            return u.asInteger() OPERATOR v.asInteger();             \
+        }                                                            \
+        return to_number(u) OPERATOR to_number(v);                   \
+    }
+DISSEMBLANCE_AOT_COMPARISON(equal, ==)
+DISSEMBLANCE_AOT_COMPARISON(not_equal, !=)
+DISSEMBLANCE_AOT_COMPARISON(less, <)
+DISSEMBLANCE_AOT_COMPARISON(greater, >)
+DISSEMBLANCE_AOT_COMPARISON(less_eq, <=)
+DISSEMBLANCE_AOT_COMPARISON(greater_eq, >=)
+#undef DISSEMBLANCE_AOT_COMPARISON
+
+inline Value cons(Value u, Value v) {
+    return make_cons(std::move(u), std::move(v));
+}
+
+inline Value car(const Value& u) {
+    const Cons* c = dcastCons(u);
+    assert(c);
+    return c->left;
+}
+
+inline Value cdr(const Value& u) {
+    const Cons* c = dcastCons(u);
+    assert(c);
+    return c->right;
+}
+
+}  // namespace aot
+}  // namespace dissemblance
+
+#endif  // aot_DEFINED
@@ -2,110 +2,247 @@
 // Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
 
 #include "dissemblance.h"
+#include "aot.h"
+#include "expression.h"
 #include "number.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <iterator>
+#include <mutex>
+#include <shared_mutex>
 #include <sstream>
 #include <unordered_map>
+#include <vector>
 
 using namespace dissemblance;
 
-struct dissemblance::Environment::Impl {
-    std::shared_ptr<Environment::Impl> outer;
-    std::unordered_map<std::string, std::shared_ptr<Expression> > map;
-};
+std::atomic<uint64_t> dissemblance::gGlobalVersion{1};
+std::atomic<bool> dissemblance::gFoldsStale{false};
+
+namespace {
+// Guards interning, and the maps of top-level bindings, once other threads
+// may be reading them.
+std::mutex gSymbolsLock;
+std::shared_mutex gBindingsLock;
+
+// For load_global() and store_global().
+std::shared_mutex gGlobalLocks[64];
+
+std::shared_mutex& global_lock(const Value* binding) {
+    return gGlobalLocks[reinterpret_cast<uintptr_t>(binding) / sizeof(Value) % 64];
+}
+}  // namespace
+
+Value dissemblance::load_global(const Value* binding) {
+    if (!gThreaded) {
+        return *binding;
+    }
+    std::shared_lock<std::shared_mutex> lock(global_lock(binding));
+    return *binding;
+}
+
+void dissemblance::store_global(Value* binding, Value value) {
+    {
+        std::unique_lock<std::shared_mutex> lock(global_lock(binding), std::defer_lock);
+        if (gThreaded) {
+            lock.lock();
+        }
+        std::swap(*binding, value);
+    }
+    // `value` is the old value now, released outside the lock.
+}
 
 dissemblance::Environment::Environment(Environment&&) = default;
 dissemblance::Environment::Environment(const Environment&) = default;
 Environment& dissemblance::Environment::operator=(Environment&&) = default;
 Environment& dissemblance::Environment::operator=(const Environment&) = default;
 
-using Env = dissemblance::Environment::Impl;
+const Symbol* dissemblance::intern(std::string_view name) {
+    // Keyed on views of the symbols' own names.
+    static auto table = new std::unordered_map<std::string_view, Value>;
+    std::unique_lock<std::mutex> lock(gSymbolsLock, std::defer_lock);
+    if (gThreaded) {
+        lock.lock();
+    }
+    auto i = table->find(name);
+    if (i == table->end()) {
+        auto symbol = new Symbol(std::string(name));
+        i = table->emplace(symbol->name, Value(symbol)).first;
+    }
+    return static_cast<const Symbol*>(i->second.get());
+}
 
-static std::shared_ptr<Expression> evaluate(
-        const std::shared_ptr<Expression>& expr,
-        std::shared_ptr<Env>& env);
+namespace {
+// The binding of `s` nearest `env`, and, in *where, the environment it is in.
+// Frozen environments never change, so are read without locking.
+Value* lookup(Env* env, const Symbol* s, Env** where) {
+    while (env) {
+        std::shared_lock<std::shared_mutex> lock(gBindingsLock, std::defer_lock);
+        if (gThreaded && !env->frozen) {
+            lock.lock();
+        }
+        const auto emap = &env->map;
+        if (!emap->empty()) {  // lambda frames rarely have named bindings.
+            auto i = emap->find(s);
+            if (i != emap->end()) {
+                *where = env;
+                return &i->second;
+            }
+        }
+        env = env->outer.get();
+    }
+    return nullptr;
+}
+}  // namespace
 
-static const Cons* dcastCons(const std::shared_ptr<Expression>& u) {
-    return u ? u->asCons() : nullptr;
+Value* dissemblance::find(Env* env, const Symbol* s) {
+    Env* where;
+    return lookup(env, s, &where);
 }
-static const Symbol* dcastSymbol(const std::shared_ptr<Expression>& u) {
-    return u ? u->asSymbol() : nullptr;
+
+Value* dissemblance::assign(Env* env, const Symbol* s) {
+    Env* where;
+    Value* binding = lookup(env, s, &where);
+    assert(!binding || !where->frozen);
+    if (s->folded.load(std::memory_order_relaxed)) {
+        gFoldsStale.store(true, std::memory_order_relaxed);
+    }
+    return binding;
 }
-static const NumberValue* dcastNumberValue(const std::shared_ptr<Expression>& u) {
-    return u ? u->asNumberValue() : nullptr;
+
+Value& dissemblance::define(Env* env, const Symbol* symbol) {
+    std::unique_lock<std::shared_mutex> lock(gBindingsLock, std::defer_lock);
+    if (gThreaded) {
+        lock.lock();
+    }
+    assert(!env->frozen);
+    assert(env->map.find(symbol) == env->map.end());
+    if (symbol->folded.load(std::memory_order_relaxed)) {
+        gFoldsStale.store(true, std::memory_order_relaxed);
+    }
+    Value& binding = env->map[symbol];
+    // Lookups that miss are not cached, so only shadowing a binding further
+    // out can make a cache stale.  A script under --serve defining its own
+    // names leaves every other thread's caches alone.
+    for (Env* outer = env->outer.get(); outer; outer = outer->outer.get()) {
+        if (outer->map.count(symbol)) {
+            ++gGlobalVersion;
+            break;
+        }
+    }
+    return binding;
 }
 
-struct dissemblance::NumberValue : public Expression {
-    Number value;
-    NumberValue(Number v) : value(v) {}
-    const NumberValue* asNumberValue() const override { return this; }
-    void serialize(std::ostream* o) const override {
-        return value.serialize(o);
+int dissemblance::length(const Value& expr, int accumulator) {
+    const Value* rest = &expr;
+    while (*rest) {
+        const Cons* c = dcastCons(*rest);
+        if (!c) {
+            return -1; // not well formed list
+        }
+        ++accumulator;
+        rest = &c->right;
     }
-};
+    return accumulator;
+}
 
-struct dissemblance::Symbol : public Expression {
-    std::string name ;
-    Symbol(const std::string& n) : name(n) {}
-    const Symbol* asSymbol() const override { return this; }
-    void serialize(std::ostream* o) const override { *o << name; }
-};
+const Value& dissemblance::get_item(
+        const Value& expr, int index) {
+    const Cons* cons = dcastCons(expr);
+    assert(cons);
+    for (; index > 0; --index) {
+        cons = dcastCons(cons->right);
+        assert(cons);
+    }
+    return cons->left;
+}
 
-struct dissemblance::Cons : public Expression {
-    std::shared_ptr<Expression> left;
-    std::shared_ptr<Expression> right;
-    Cons(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r)
-        : left(std::move(l)), right(std::move(r)) {}
-    const Cons* asCons() const override { return this; }
-    void serialize(std::ostream* o) const override {
-        *o << "(";
-        this->innerSerialize(o);
-        *o << ")";
-    }
-    void innerSerialize(std::ostream* o) const {
-        Expression::Serialize(left.get(), o);
-        const Cons* current = this;
-        while (const Cons* rightCons = dcastCons(current->right)) {
-            *o << " ";
-            Expression::Serialize(rightCons->left.get(), o);
-            current = rightCons;
-        }
-        if (current->right) {
-            *o << " . ";
-            Expression::Serialize(current->right.get(), o);
-        }
+void dissemblance::get_items(
+        const Value& expr, const Value** items, int count) {
+    const Value* rest = &expr;
+    for (int i = 0; i < count; ++i) {
+        const Cons* cons = dcastCons(*rest);
+        assert(cons);  // too few.
+        items[i] = &cons->left;
+        rest = &cons->right;
     }
-};
+    assert(!*rest);  // too many.
+}
 
-static std::shared_ptr<Cons> make_cons(std::shared_ptr<Expression> l,
-                                       std::shared_ptr<Expression> r) {
-    return std::make_shared<Cons>(std::move(l), std::move(r));
+const Symbol* dissemblance::get_symbol(const Value& expr) {
+    const Symbol* symbol = dcastSymbol(expr);
+    if (!symbol) {
+        std::cerr << "missing symbol: ";
+        Expression::Serialize(expr, &std::cerr);
+        std::cerr << "\n";
+    }
+    assert(symbol);
+    return symbol;
 }
 
-struct dissemblance::Procedure : public Expression {
-public:
-    const Procedure* asProcedure() const override { return this; }
-    virtual std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const = 0;
-};
+Value dissemblance::Procedure::apply(
+        const Value*, int) const {
+    std::cerr << "not applicable: ";
+    this->serialize(&std::cerr);
+    std::cerr << "\n";
+    assert(false);
+    return nullptr;
+}
 
-namespace {
+// eval() for procedures that implement tailEval().
+static Value eval_tail(
+        const Procedure* proc,
+        const Value& expr,
+        Ref<Env>& env) {
+    ProfileMark mark;
+    Procedure::Tail tail;
+    auto value = proc->tailEval(expr, env, &tail);
+    if (!tail.expr) {
+        return value;
+    }
+    return evaluate(tail.expr, tail.env ? tail.env : env);
+}
 
-static std::shared_ptr<Expression>* find(Env* env, const std::string& s) {
-    while (env) {
-        const auto emap = &env->map;
-        auto i = emap->find(s);
-        if (i != emap->end()) {
-            return &i->second;
+Value dissemblance::eval_apply(
+        const Procedure* proc,
+        const Value& expr,
+        Ref<Env>& env) {
+    // The operands are evaluated in one walk down the list, into `buffer`
+    // while they fit.
+    Value buffer[4];
+    std::vector<Value> overflow;
+    int count = 0;
+    const Value* rest = &expr;
+    while (const Cons* c = dcastCons(*rest)) {
+        if (count < 4) {
+            buffer[count] = evaluate(c->left, env);
+        } else {
+            if (count == 4) {
+                overflow.assign(std::make_move_iterator(buffer),
+                                std::make_move_iterator(buffer + 4));
+            }
+            overflow.push_back(evaluate(c->left, env));
         }
-        env = env->outer.get();
+        ++count;
+        rest = &c->right;
     }
-    return nullptr;
+    assert(!*rest);  // a proper list.
+    Value* args = count > 4 ? overflow.data() : buffer;
+    if (gProfiling) {
+        // The operands were evaluated in the caller's frame, as the VM does.
+        size_t depth = profile_depth();
+        profile_enter(proc);
+        auto value = proc->apply(args, count);
+        profile_exit_to(depth);
+        return value;
+    }
+    return proc->apply(args, count);
 }
 
+namespace {
+
 struct Token {
     enum Type {
         Atom,
@@ -114,308 +251,625 @@ struct Token {
         Apostrophe,
         Dot,
         Eof,
-    } type;
-    Token(Type t) : type(t) {}
-    std::string atom;
-    Token(const std::string& s) : type(Atom), atom(s) {}
+    };
+};
+
+// What each byte means to the tokenizer.
+enum CharClass : uint8_t {
+    kAtomChar   = 0,
+    kSpace      = 1,
+    kDelimiter  = 2,  // ends an atom.
+};
+
+struct CharTable {
+    uint8_t classes[256];
+    uint8_t tokens[256];  // the Token::Type a byte starts.
+    CharTable() {
+        for (int c = 0; c < 256; ++c) {
+            classes[c] = kAtomChar;
+            tokens[c] = Token::Atom;
+        }
+        for (unsigned char c : {' ', '\t', '\n'}) {
+            classes[c] = kSpace | kDelimiter;
+        }
+        classes['('] = classes[')'] = kDelimiter;
+        tokens['('] = Token::OpenParen;
+        tokens[')'] = Token::CloseParen;
+        tokens['\''] = Token::Apostrophe;
+        tokens['.'] = Token::Dot;
+    }
 };
 
+const CharTable kChars;
+
+inline bool is_space(char c) { return kChars.classes[(unsigned char)c] & kSpace; }
+inline bool is_delimiter(char c) { return kChars.classes[(unsigned char)c] & kDelimiter; }
+
+// Splits a buffer into tokens.  Atoms are views into the buffer.
 class Tokenizer {
-    std::istream* ins;
-    int nextChar;
-    void read() { nextChar = ins->get(); }
+    const char* cursor;
+    const char* end;
+    std::string_view atomText;
 public:
-    Tokenizer(std::istream* i) : ins(i), nextChar(i->get()) {}
+    Tokenizer(const char* b, const char* e) : cursor(b), end(e) {}
+    const char* position() const { return cursor; }
+    // The text of the last Atom returned by next().
+    std::string_view atom() const { return atomText; }
     Token::Type peek() {
-        while (true) {
-            switch (nextChar) {
-                case EOF:
-                    return Token::Eof;
-                case ' ':
-                case '\t':
-                case '\n':
-                    this->read();
-                    break;
-                case '\'':
-                    return Token:: Apostrophe;
-                case '(':
-                    return Token::OpenParen;
-                case ')':
-                    return Token::CloseParen;
-                case '.':
-                    return Token::Dot;
-                default:
-                    return Token::Atom;
-            }
+        while (cursor != end && is_space(*cursor)) {
+            ++cursor;
         }
+        if (cursor == end) {
+            return Token::Eof;
+        }
+        return (Token::Type)kChars.tokens[(unsigned char)*cursor];
     }
-    Token next() {
+    Token::Type next() {
         Token::Type type = this->peek();
         if (type == Token::Atom) {
-            std::stringstream atom;
+            const char* start = cursor;
             do {
-                atom << static_cast<char>(nextChar);
-                this->read();
-                if (EOF == nextChar ||
-                    nullptr != strchr(" )(\t\n", nextChar)) {
-                    return Token(atom.str());
-                }
-            } while (true);
-        } else {
-            this->read();
-            return Token(type);
+                ++cursor;
+            } while (cursor != end && !is_delimiter(*cursor));
+            atomText = std::string_view(start, cursor - start);
+        } else if (type != Token::Eof) {
+            ++cursor;
         }
+        return type;
     }
 };
 
-std::shared_ptr<Expression> MakeAtom(const std::string& s) {
+// Copies the text of one expression from a stream, leaving whatever follows
+// it unread.
+void read_expression(std::streambuf* in, std::string* text) {
+    int depth = 0;
+    while (true) {
+        int c = in->sgetc();
+        if (c == EOF) {
+            return;
+        }
+        text->push_back((char)c);
+        in->sbumpc();
+        switch (kChars.tokens[c]) {
+            case Token::OpenParen:
+                ++depth;
+                break;
+            case Token::CloseParen:
+                if (--depth <= 0) {
+                    return;
+                }
+                break;
+            case Token::Atom:
+            case Token::Dot:
+                if (is_space((char)c)) {
+                    break;
+                }
+                while ((c = in->sgetc()) != EOF && !is_delimiter((char)c)) {
+                    text->push_back((char)c);
+                    in->sbumpc();
+                }
+                if (depth == 0) {
+                    return;
+                }
+                break;
+            default:
+                break;  // an apostrophe, which the next expression follows.
+        }
+    }
+}
+
+Value MakeAtom(std::string_view s) {
     assert(s.size() > 0);
     if ('0' <= s[0] && s[0] <= '9') {
         //must be some kind of number
-        return std::make_shared<NumberValue>(Number(s));
+        return gHashConsing ? hash_number(Number(s)) : make_number(Number(s));
     } else {
-        return std::make_shared<Symbol>(s);
+        return Value(intern(s));
     }
 }
 
-static std::shared_ptr<dissemblance::Expression> quote();
+static Value quote();
 
-static std::shared_ptr<Expression> parse_expression(Tokenizer*);
+// Parses one expression without recursion, so that neither long nor deeply
+// nested lists can overflow the stack.  Each open list is appended to at its
+// last cell as its elements are parsed; with hash-consing, each is consed up
+// from its end once it is closed instead.
+class Parser {
+    struct Open {
+        bool quote;     // an apostrophe, waiting for the expression it quotes.
+        Value list;
+        Cons* last;     // the list's last cell, or null while it is empty.
+        bool dotted;    // the next expression is the list's final cdr.
+        bool finished;  // ... and it has been parsed.
+        size_t first;   // with hash-consing, where its elements begin.
+    };
+    std::vector<Open> stack;
+    // With hash-consing, the elements of the open lists, innermost last.
+    std::vector<Value> elements;
 
-static std::shared_ptr<Expression> parse_list(Tokenizer*);
-
-static std::shared_ptr<Expression> parse_rest(Tokenizer* tokenizer) {
-    std::shared_ptr<Expression> right;
-    if (Token::Dot == tokenizer->peek()) {
-        tokenizer->next();
-        right = parse_expression(tokenizer);
-        assert(tokenizer->peek() == Token::CloseParen);
-        tokenizer->next();
-    } else {
-        right = parse_list(tokenizer);
-    }
-    return right;
-}
-
-static std::shared_ptr<Expression> parse_list(Tokenizer* tokenizer) {
-    std::shared_ptr<Expression> left;
-    Token token = tokenizer->next();
-    switch (token.type) {
-        case Token::Atom:
-            left = MakeAtom(token.atom);
-            return make_cons(std::move(left), parse_rest(tokenizer));
-        case Token::OpenParen:
-            left = parse_list(tokenizer);
-            return make_cons(std::move(left), parse_list(tokenizer));
-        case Token::CloseParen:
-            return nullptr;
-        case Token::Apostrophe:
-            left = make_cons(quote(), make_cons(parse_expression(tokenizer), nullptr));
-            return make_cons(std::move(left), parse_rest(tokenizer));
-        case Token::Eof:
-        case Token::Dot:
-        default:
-            assert(false);
-            return nullptr;
+    bool empty(const Open& open) const {
+        return !open.last && elements.size() == open.first;
     }
-}
 
-static std::shared_ptr<Expression> parse_expression(Tokenizer* tokenizer) {
-    Token token = tokenizer->next();
-    switch (token.type) {
-        case Token::Apostrophe:
-            return make_cons(quote(), make_cons(parse_expression(tokenizer), nullptr));
-        case Token::Atom:
-            return MakeAtom(token.atom);
-        case Token::OpenParen:
-            return parse_list(tokenizer);
-        case Token::Eof:
-            return nullptr;
-        case Token::CloseParen:
-        case Token::Dot:
-        default:
-            assert(false);
-            return nullptr;
+    Value close(const Open& open) {
+        Value list;
+        if (open.dotted) {
+            list = std::move(elements.back());
+            elements.pop_back();
+        }
+        while (elements.size() > open.first) {
+            list = hash_cons(std::move(elements.back()), std::move(list));
+            elements.pop_back();
+        }
+        return list;
     }
-}
 
-////////////////////////////////////////////////////////////////////////////////
-
-int length(const std::shared_ptr<Expression>& expr, int accumulator = 0) {
-    if (!expr) { return accumulator; }
-    const Cons* c = dcastCons(expr);
-    if (!c) {
-        return -1; // not well formed list
+    // Gives a parsed expression to the innermost open list or quote.  Returns
+    // true once it is the whole expression.
+    bool add(Value* expr) {
+        while (!stack.empty() && stack.back().quote) {
+            *expr = gHashConsing
+                  ? hash_cons(quote(), hash_cons(std::move(*expr), nullptr))
+                  : make_cons(quote(), make_cons(std::move(*expr), nullptr));
+            stack.pop_back();
+        }
+        if (stack.empty()) {
+            return true;
+        }
+        Open& open = stack.back();
+        assert(!open.finished);
+        if (gHashConsing) {
+            elements.push_back(std::move(*expr));
+            open.finished = open.dotted;
+            return false;
+        }
+        if (open.dotted) {
+            open.last->right = std::move(*expr);
+            open.finished = true;
+            return false;
+        }
+        Cons* cell = new Cons(std::move(*expr), nullptr);
+        if (open.last) {
+            open.last->right = Value(cell);
+        } else {
+            open.list = Value(cell);
+        }
+        open.last = cell;
+        return false;
     }
-    return length(c->right, 1 + accumulator);
-}
 
-const std::shared_ptr<Expression>& get_item(
-        const std::shared_ptr<Expression>& expr, int index) {
-    const Cons* cons = dcastCons(expr);
-    assert(cons);
-    if (0 == index) {
-        return cons->left;
-    } else {
-        return get_item(cons->right, index - 1);
+public:
+    Value parse(Tokenizer* tokenizer) {
+        stack.clear();
+        elements.clear();
+        Value expr;
+        while (true) {
+            switch (tokenizer->next()) {
+                case Token::Atom:
+                    expr = MakeAtom(tokenizer->atom());
+                    break;
+                case Token::OpenParen:
+                    stack.push_back(Open{false, nullptr, nullptr, false, false, elements.size()});
+                    continue;
+                case Token::Apostrophe:
+                    stack.push_back(Open{true, nullptr, nullptr, false, false, elements.size()});
+                    continue;
+                case Token::Dot:
+                    assert(!stack.empty() && !stack.back().quote && !this->empty(stack.back()));
+                    assert(!stack.back().dotted);
+                    stack.back().dotted = true;
+                    continue;
+                case Token::CloseParen:
+                    assert(!stack.empty() && !stack.back().quote);
+                    assert(stack.back().finished || !stack.back().dotted);
+                    expr = gHashConsing ? this->close(stack.back())
+                                        : std::move(stack.back().list);
+                    stack.pop_back();
+                    break;
+                case Token::Eof:
+                default:
+                    assert(stack.empty());
+                    return nullptr;
+            }
+            if (this->add(&expr)) {
+                return expr;
+            }
+        }
     }
-}
+};
 
-const std::string& get_symbol(const std::shared_ptr<Expression>& expr) {
-    const Symbol* symbol = dcastSymbol(expr);
-    if (!symbol) {
-        std::cerr << "missing symbol: ";
-        Expression::Serialize(expr.get(), &std::cerr);
-        std::cerr << "\n";
-    }
-    assert(symbol);
-    return symbol->name;
-}
+////////////////////////////////////////////////////////////////////////////////
 
 
 class Quote : public Procedure {
 public:
     void serialize(std::ostream* o) const override { *o << "quote"; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
-        assert(1 == length(expr));
-        return get_item(expr, 0);
+    Form form() const override { return QuoteForm; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>&) const override {
+        const Value* operand;
+        get_items(expr, &operand, 1);
+        return *operand;
     }
 };
 
-static std::shared_ptr<dissemblance::Expression> quote() {
-   return std::make_shared<Quote>();
+// One, shared by every quoted expression, so that equal quoted expressions
+// are equal structures.
+static Value quote() {
+    static const Value* shared = new Value(new Quote);
+    return *shared;
 }
 
 class List : public Procedure {
     void serialize(std::ostream* o) const override { *o << "list"; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
-        std::shared_ptr<Cons> top;
-        if (const Cons* c = dcastCons(expr)) {
-            top = make_cons(evaluate(c->left, env), nullptr);
-            Cons* ptr = top.get();
-            while ((c = dcastCons(c->right))) {
-                ptr->right = make_cons(evaluate(c->left, env), nullptr);
-                ptr = (Cons*)(ptr->right.get());
-            }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+    Value apply(
+            const Value* args, int count) const override {
+        Value list;
+        while (count > 0) {
+            --count;
+            list = make_cons(args[count], std::move(list));
         }
-        return top;
+        return list;
     }
 };
 
 class Begin : public Procedure {
 public:
     void serialize(std::ostream* o) const override { *o << "begin"; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
-        return Begin::Beginner(expr, env);
+    Form form() const override { return BeginForm; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_tail(this, expr, env);
     }
-
-private:
-    static std::shared_ptr<Expression> Beginner(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) {
+    Value tailEval(
+            const Value& expr,
+            Ref<Env>& env,
+            Tail* tail) const override {
         const Cons* cons = dcastCons(expr);
         assert(cons); // takes list
-        auto value = evaluate(cons->left, env);
-        if (cons->right) {
-            return Begin::Beginner(cons->right, env);
-        } else {
-            return std::move(value);
+        tail->expr = Begin::Beginner(cons, env);
+        return nullptr;
+    }
+
+    // Evaluates all but the last of a list of forms, and returns the last.
+    static const Value& Beginner(
+            const Cons* cons,
+            Ref<Env>& env) {
+        while (const Cons* next = dcastCons(cons->right)) {
+            evaluate(cons->left, env);
+            cons = next;
         }
+        return cons->left;
     }
 };
 
-class LambdaProc : public Procedure {
-    std::shared_ptr<Expression> parameters;
-    std::shared_ptr<Expression> procedure;
-    std::shared_ptr<Env> environment;
+// Turns a lambda expression into LambdaCode, giving each variable a slot in
+// the lambda's frame and resolving references to the variables of the
+// lambda and of the lambdas enclosing it.  Any other symbol names a
+// top-level binding, and is replaced with a GlobalRef, which caches where it
+// finds the binding.
+//
+// The body is simplified as it is resolved: calls of pure builtins on
+// constants are replaced by their values, `if`s with constant conditions by
+// the branch they take, and nested `begin`s by one.  Builtins are recognized
+// by what their names are bound to when the lambda is created, as the
+// compiler recognizes special forms.  Printing a lambda shows its simplified
+// body.  Since a name may be bound to something else later, a lambda with
+// anything folded keeps its body unfolded too, to run once any name folded
+// by any lambda is set or defined again.
+class Resolver {
+    Env* env;
+    // Variables of each enclosing frame, innermost last.
+    std::vector<const std::vector<const Symbol*>*> scopes;
+    LambdaCode* current = nullptr;
+    // The current lambda's internal defines not yet reached in its body,
+    // whose names still mean what they mean outside it there.
+    std::vector<const Symbol*> pending;
+    bool folding = true;
+    int folds = 0;  // in the current lambda's body.
+
+    bool is_pending(const Symbol* symbol) const {
+        return std::find(pending.begin(), pending.end(), symbol) != pending.end();
+    }
+
+    Value reference(const Symbol* symbol) const {
+        for (size_t depth = 0; depth < scopes.size(); ++depth) {
+            const auto& variables = *scopes[scopes.size() - 1 - depth];
+            if (current && &variables == &current->variables && this->is_pending(symbol)) {
+                continue;
+            }
+            for (size_t slot = 0; slot < variables.size(); ++slot) {
+                if (variables[slot] == symbol) {
+                    return Value(new LocalRef(symbol, (int)depth, (int)slot));
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // What `head` is bound to now, if it names a global.
+    Value global(const Value& head) const {
+        const Symbol* symbol = dcastSymbol(head);
+        if (const GlobalRef* ref = dcastGlobalRef(head)) {
+            symbol = ref->symbol;
+        } else if (!symbol || this->reference(symbol)) {
+            return head;
+        }
+        Value* ptr = find(env, symbol);
+        return ptr ? *ptr : nullptr;
+    }
+
+    // Works on resolved forms too.
+    Procedure::Form form(const Value& head) const {
+        const Procedure* proc = dcastProcedure(this->global(head));
+        return proc ? proc->form() : Procedure::Application;
+    }
+
+    // Until its define is reached, a name defined in the body is seen only by
+    // the lambdas in the body, which are not called before then.
+    void declare(const Symbol* symbol) {
+        auto& variables = current->variables;
+        if (std::find(variables.begin(), variables.end(), symbol) == variables.end()) {
+            variables.push_back(symbol);
+            pending.push_back(symbol);
+        }
+    }
+
+    Value resolve(const Value& expr) {
+        if (const Symbol* symbol = dcastSymbol(expr)) {
+            auto ref = this->reference(symbol);
+            return ref ? ref : Value(new GlobalRef(symbol));
+        }
+        const Cons* cons = dcastCons(expr);
+        if (!cons) {
+            return expr;
+        }
+        switch (Procedure::Form form = this->form(cons->left)) {
+            case Procedure::QuoteForm:
+                return make_cons(this->resolve(cons->left), cons->right);
+            case Procedure::LambdaForm:
+                return make_cons(Value(new MakeClosure(this->lambda(cons->right))),
+                                 cons->right);
+            case Procedure::DefineForm:
+            case Procedure::SetForm: {
+                assert(2 == length(cons->right));
+                const auto& variable = get_item(cons->right, 0);
+                const Symbol* symbol = get_symbol(variable);
+                if (form == Procedure::DefineForm) {
+                    this->declare(symbol);
+                }
+                auto value = make_cons(this->resolve(get_item(cons->right, 1)), nullptr);
+                if (form == Procedure::DefineForm) {
+                    pending.erase(std::remove(pending.begin(), pending.end(), symbol),
+                                  pending.end());
+                }
+                auto ref = this->reference(symbol);
+                if (!ref) {
+                    return make_cons(this->resolve(cons->left),
+                                     make_cons(variable, std::move(value)));
+                }
+                return make_cons(
+                        Value(new SetLocal(form)),
+                        make_cons(std::move(ref), std::move(value)));
+            }
+            case Procedure::IfForm:
+                return this->prune(this->resolveList(expr));
+            case Procedure::BeginForm:
+                return this->flatten(this->resolveList(expr));
+            case Procedure::Application:
+            default:
+                return this->fold(this->resolveList(expr));
+        }
+    }
+
+    // What a resolved expression always evaluates to itself.
+    static bool is_constant(const Value& expr) { return !expr || is_number(expr); }
+
+    // (* 60 60 24) => 86400, while `*` is bound to the builtin.
+    Value fold(Value expr) {
+        const Cons* cons = dcastCons(expr);
+        const GlobalRef* ref = dcastGlobalRef(cons->left);
+        const Procedure* proc = dcastProcedure(this->global(cons->left));
+        if (!folding || !ref || !proc) {
+            return expr;
+        }
+        std::vector<Value> args;
+        const Value* rest = &cons->right;
+        while (const Cons* c = dcastCons(*rest)) {
+            if (!is_constant(c->left)) {
+                return expr;
+            }
+            args.push_back(c->left);
+            rest = &c->right;
+        }
+        if (*rest || !proc->foldable(args.data(), (int)args.size())) {
+            return expr;
+        }
+        ref->symbol->folded.store(true, std::memory_order_relaxed);
+        ++folds;
+        return proc->apply(args.data(), (int)args.size());
+    }
+
+    // (if (< 1 2) a b) => a
+    static Value prune(Value expr) {
+        //        0     1    2
+        // (if . (cond then else))
+        const Value& operands = dcastCons(expr)->right;
+        if (3 != length(operands) || !is_constant(get_item(operands, 0))) {
+            return expr;
+        }
+        return get_item(operands, get_item(operands, 0) ? 1 : 2);
+    }
+
+    // (begin a (begin b c) d) => (begin a b c d), and (begin a) => a
+    Value flatten(Value expr) const {
+        const Cons* cons = dcastCons(expr);
+        if (!dcastCons(cons->right)) {
+            return expr;
+        }
+        Value forms = this->sequence(cons->right);
+        if (!dcastCons(forms)->right) {
+            return dcastCons(forms)->left;
+        }
+        return make_cons(cons->left, std::move(forms));
+    }
+
+    // Splices the forms of each `begin` into a list of forms evaluated in
+    // order, and drops constants whose values would be discarded.
+    Value sequence(const Value& forms) const {
+        std::vector<Value> flat;
+        bool changed = false;
+        for (const Cons* c = dcastCons(forms); c; c = dcastCons(c->right)) {
+            const Cons* form = dcastCons(c->left);
+            if (form && dcastCons(form->right) &&
+                Procedure::BeginForm == this->form(form->left)) {
+                // Already flattened, when it was resolved.
+                for (const Cons* f = dcastCons(form->right); f; f = dcastCons(f->right)) {
+                    flat.push_back(f->left);
+                }
+                changed = true;
+            } else {
+                flat.push_back(c->left);
+                changed = changed || (c->right && is_constant(c->left));
+            }
+        }
+        if (!changed) {
+            return forms;
+        }
+        Value list = make_cons(std::move(flat.back()), nullptr);
+        for (auto i = flat.rbegin() + 1; i != flat.rend(); ++i) {
+            if (!is_constant(*i)) {
+                list = make_cons(std::move(*i), std::move(list));
+            }
+        }
+        return list;
+    }
+
+    Value resolveList(const Value& list) {
+        const Cons* cons = dcastCons(list);
+        if (!cons) {
+            return this->resolve(list);
+        }
+        auto left = this->resolve(cons->left);
+        return make_cons(std::move(left), this->resolveList(cons->right));
+    }
+
 public:
-    // (lambda (x) (+ 3 x))
-    // (lambda (x y) (+ 3 x y))
-    LambdaProc(std::shared_ptr<Expression> expr, std::shared_ptr<Env>& env)
-        : environment(env) {
+    // Resolves lambdas created in `e`, which may itself be a lambda frame.
+    Resolver(Env* e) : env(e) {
+        for (Env* frame = e; frame; frame = frame->outer.get()) {
+            if (frame->code) {
+                scopes.insert(scopes.begin(), &frame->code->variables);
+            }
+        }
+    }
+
+    // (lambda . ((x y) (+ 3 x y)))
+    std::shared_ptr<const LambdaCode> lambda(const Value& expr) {
         const Cons* cons = dcastCons(expr);
         assert(cons); // takes list
-        parameters = cons->left;
-        assert(length(parameters) >= 0);
-
-        assert(cons->right);
+        auto code = std::make_shared<LambdaCode>();
+        code->parameters = cons->left;
+        assert(length(code->parameters) >= 0);
+        for (const Cons* p = dcastCons(code->parameters); p; p = dcastCons(p->right)) {
+            code->variables.push_back(get_symbol(p->left));
+        }
+        code->arity = (int)code->variables.size();
         assert(length(cons->right) >= 1);
-        procedure = make_cons(std::make_shared<Symbol>(std::string("begin")), cons->right);
-    }
-    void serialize(std::ostream* o) const override {
-        *o << "(lambda ";
-        Expression::Serialize(parameters.get(), o);
-        *o << " ";
-        dcastCons(dcastCons(procedure)->right)->innerSerialize(o);
-        *o << ")";
-    }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& arguments,
-            std::shared_ptr<Env>& env) const override {
-        auto scope = std::make_shared<Env>();
-        scope->outer = environment;
-        const Cons* params = dcastCons(parameters);
-        const Cons* args = dcastCons(arguments);
-        while (params) {
-            const std::string& symb = get_symbol(params->left);
-            scope->map[symb] = evaluate(args->left, env);
-            params = dcastCons(params->right);
-            args = dcastCons(args->right);
-            assert((params == nullptr) == (args == nullptr));
-        }
-        return evaluate(procedure, scope);
+
+        LambdaCode* outer = current;
+        current = code.get();
+        scopes.push_back(&code->variables);
+        std::vector<const Symbol*> outerPending;
+        pending.swap(outerPending);
+        // Internal defines get their slots up front, so that the lambdas
+        // defined before them in the body can call them.
+        for (const Cons* c = dcastCons(cons->right); c; c = dcastCons(c->right)) {
+            const Cons* form = dcastCons(c->left);
+            if (form && Procedure::DefineForm == this->form(form->left)) {
+                this->declare(get_symbol(get_item(form->right, 0)));
+            }
+        }
+        std::vector<const Symbol*> declared = pending;
+        int outerFolds = folds;
+        folds = 0;
+        code->body = this->sequence(this->resolveList(cons->right));
+        if (folds) {
+            folding = false;
+            pending = declared;
+            code->unfolded = this->sequence(this->resolveList(cons->right));
+            folding = true;
+        }
+        folds = outerFolds;
+        pending.swap(outerPending);
+        scopes.pop_back();
+        current = outer;
+        return code;
     }
 };
 
 class Lambda : public Procedure {
 public:
     void serialize(std::ostream* o) const override { *o << "LAMBDA"; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
-        return std::make_shared<LambdaProc>(expr, env);
+    Form form() const override { return LambdaForm; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return Value(new LambdaProc(Resolver(env.get()).lambda(expr), env));
     }
 };
 
-const Number& to_number(const std::shared_ptr<Expression>& expr) {
-    const NumberValue* nv = dcastNumberValue(expr);
-    assert(nv);  // is a number
-    return nv->value;
-}
-
 typedef Number (*BinOp)(Number, Number);
+typedef bool (*IntOp)(int64_t, int64_t, int64_t*);
 
-template <BinOp Op, int Identity>
-class Accumulate : public Procedure {
-    static Number Do(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env,
-            Number accumulator) {
-        const Cons* c = dcastCons(expr);
-        if (!c) {
-            return accumulator;
-        } else {
-            return Accumulate<Op, Identity>::Do(
-                    c->right, env,
-                    Op(accumulator, to_number(evaluate(c->left, env))));
+bool all_numbers(const Value* args, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (!is_number(args[i])) {
+            return false;
         }
     }
+    return true;
+}
+
+template <BinOp Op, IntOp CheckedOp, int Identity>
+class Accumulate : public Procedure {
     const char* name;
 
 public:
     Accumulate(const char* n) : name(n) {}
     void serialize(std::ostream* o) const override { *o << name; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
-        return std::make_shared<NumberValue>(
-                Accumulate<Op, Identity>::Do(expr, env, Number(Identity)));
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+    Value apply(
+            const Value* args, int count) const override {
+        // Integers, the usual case, until one is not or the total overflows.
+        int64_t total = Identity;
+        int i = 0;
+        while (i < count && args[i].isInteger() &&
+               CheckedOp(total, args[i].asInteger(), &total)) {
+            ++i;
+        }
+        if (i == count) {
+            return make_number(Number(total));
+        }
+        Number accumulator(total);
+        for (; i < count; ++i) {
+            accumulator = Op(accumulator, to_number(args[i]));
+        }
+        return make_number(accumulator);
+    }
+    bool foldable(const Value* args, int count) const override {
+        return all_numbers(args, count);
     }
 };
 
@@ -423,23 +877,33 @@ public:
 class Subtract : public Procedure {
 public:
     void serialize(std::ostream* o) const override { *o << "SUBTRACT"; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+    Value apply(
+            const Value* args, int count) const override {
         static const Number ZERO(0);
-        switch (length(expr)) {
+        switch (count) {
             case 1:
                 // (- value)
-                return std::make_shared<NumberValue>(
-                        ZERO - to_number(evaluate(get_item(expr, 0), env)));
+                return make_number(ZERO - to_number(args[0]));
             case 2:
-                return std::make_shared<NumberValue>(
-                        to_number(evaluate(get_item(expr, 0), env))
-                        - to_number(evaluate(get_item(expr, 1), env)));
+                if (args[0].isInteger() && args[1].isInteger()) {
+                    // Immediate integers are too small to overflow.
+                    return make_number(Number(args[0].asInteger() - args[1].asInteger()));
+                }
+                return make_number(
+                        to_number(args[0]) - to_number(args[1]));
             default:
                 assert(false);
+                return nullptr;
         }
     }
+    bool foldable(const Value* args, int count) const override {
+        return (1 == count || 2 == count) && all_numbers(args, count);
+    }
 };
 
 template <BinOp Op>
@@ -449,13 +913,21 @@ private:
 public:
     BinaryOperation(const char* n) : name(n) {}
     void serialize(std::ostream* o) const override { *o << name; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
-        assert(2 == length(expr));
-        return std::make_shared<NumberValue>(
-                Op(to_number(evaluate(get_item(expr, 0), env)),
-                   to_number(evaluate(get_item(expr, 1), env))));
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+    Value apply(
+            const Value* args, int count) const override {
+        assert(2 == count);
+        return make_number(
+                Op(to_number(args[0]), to_number(args[1])));
+    }
+    // Leaves integer division by zero to fail when it is run.
+    bool foldable(const Value* args, int count) const override {
+        return 2 == count && all_numbers(args, count) &&
+               !(to_number(args[1]).isInt() && 0 == to_number(args[1]).asInt());
     }
 };
 
@@ -467,50 +939,63 @@ private:
 public:
     ComparisonOperation(const char* n) : name(n) {}
     void serialize(std::ostream* o) const override { *o << name; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
-        assert(2 == length(expr));
-        if (Op(to_number(evaluate(get_item(expr, 0), env)),
-               to_number(evaluate(get_item(expr, 1), env)))) {
-            return std::make_shared<NumberValue>(Number(1));  // TODO: intern this.
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+    Value apply(
+            const Value* args, int count) const override {
+        assert(2 == count);
+        if (Op(to_number(args[0]), to_number(args[1]))) {
+            return Value::Integer(1);
         } else {
             return nullptr;
         }
     }
+    bool foldable(const Value* args, int count) const override {
+        return 2 == count && all_numbers(args, count);
+    }
 };
 
 
 class If : public Procedure {
 public:
     void serialize(std::ostream* o) const override { *o << "if"; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
+    Form form() const override { return IfForm; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_tail(this, expr, env);
+    }
+    Value tailEval(
+            const Value& expr,
+            Ref<Env>& env,
+            Tail* tail) const override {
         //        0     1    2
         // (if . (cond then else))
-        assert(3 == length(expr));
-        if (evaluate(get_item(expr, 0), env)) {
-            return evaluate(get_item(expr, 1), env);
-        } else {
-            return evaluate(get_item(expr, 2), env);
-        }
+        const Value* operands[3];
+        get_items(expr, operands, 3);
+        tail->expr = evaluate(*operands[0], env) ? *operands[1] : *operands[2];
+        return nullptr;
     }
 };
 
 class Set : public Procedure {
 public:
     void serialize(std::ostream* o) const override { *o << "set!"; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
+    Form form() const override { return SetForm; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
         //          0        1
         // (set! . (variable (+ b c d))
-        assert(2 == length(expr));
-        const std::string& symbol = get_symbol(get_item(expr, 0));
-        std::shared_ptr<Expression>* ptr = find(env.get(), symbol);
+        const Value* operands[2];
+        get_items(expr, operands, 2);
+        const Symbol* symbol = get_symbol(*operands[0]);
+        Value* ptr = assign(env.get(), symbol);
         assert(ptr);
-        *ptr = evaluate(get_item(expr, 1), env);
+        store_global(ptr, evaluate(*operands[1], env));
         return nullptr;
     }
 };
@@ -518,15 +1003,19 @@ public:
 class Define : public Procedure {
 public:
     void serialize(std::ostream* o) const override { *o << "define"; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
+    Form form() const override { return DefineForm; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
         //            0        1
         // (define . (variable (+ b c d))
-        assert(2 == length(expr));
-        const std::string& symbol = get_symbol(get_item(expr, 0));
-        assert(env->map.find(symbol) == env->map.end());
-        env->map[symbol] = evaluate(get_item(expr, 1), env);
+        const Value* operands[2];
+        get_items(expr, operands, 2);
+        const Symbol* symbol = get_symbol(*operands[0]);
+        // Evaluated before it is bound, as kDefine does.
+        Value value = evaluate(*operands[1], env);
+        name_lambda(value, symbol);
+        store_global(&define(env.get(), symbol), std::move(value));
         // todo: define procedures without lambda keyword.
         return nullptr;
     }
@@ -535,40 +1024,169 @@ public:
 class ConsProc : public Procedure {
 public:
     void serialize(std::ostream* o) const override { *o << "cons"; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
-        assert(2 == length(expr));
-        return make_cons(evaluate(get_item(expr, 0), env),
-                         evaluate(get_item(expr, 1), env));
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+    Value apply(
+            const Value* args, int count) const override {
+        assert(2 == count);
+        return make_cons(args[0], args[1]);
     }
 };
 
 class CarProc : public Procedure {
 public:
     void serialize(std::ostream* o) const override { *o << "car"; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
-        assert(1 == length(expr));
-        auto value = evaluate(get_item(expr, 0), env);
-        const Cons* c = dcastCons(value);
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+    Value apply(
+            const Value* args, int count) const override {
+        assert(1 == count);
+        const Cons* c = dcastCons(args[0]);
         assert(c);
-        return std::move(c->left);
+        return c->left;
     }
 };
 
 class CdrProc : public Procedure {
 public:
     void serialize(std::ostream* o) const override { *o << "cdr"; }
-    std::shared_ptr<Expression> eval(
-            const std::shared_ptr<Expression>& expr,
-            std::shared_ptr<Env>& env) const override {
-        assert(1 == length(expr));
-        auto value = evaluate(get_item(expr, 0), env);
-        const Cons* c = dcastCons(value);
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+    Value apply(
+            const Value* args, int count) const override {
+        assert(1 == count);
+        const Cons* c = dcastCons(args[0]);
         assert(c);
-        return std::move(c->right);
+        return c->right;
+    }
+};
+
+static bool identical(const Value& u, const Value& v) {
+    return u == v;
+}
+
+// (eq? u v) compares identity, (equal? u v) structure.
+template <bool (*Same)(const Value&, const Value&)>
+class SamenessProc : public Procedure {
+private:
+    const char* name;
+public:
+    SamenessProc(const char* n) : name(n) {}
+    void serialize(std::ostream* o) const override { *o << name; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+    Value apply(
+            const Value* args, int count) const override {
+        assert(2 == count);
+        return Same(args[0], args[1]) ? Value::Integer(1) : nullptr;
+    }
+};
+
+// (heap-stats) is an association list of GetHeapStats()'s counts, by name;
+// (heap-stats 'name) is one of them.
+class HeapStatsProc : public Procedure {
+public:
+    void serialize(std::ostream* o) const override { *o << "heap-stats"; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+    Value apply(
+            const Value* args, int count) const override {
+        assert(count <= 1);
+        const Symbol* name = count ? get_symbol(args[0]) : nullptr;
+        HeapStats stats = GetHeapStats();
+        const std::pair<const char*, uint64_t> counts[] = {
+            {"conses", stats.conses},
+            {"numbers", stats.numbers},
+            {"symbols", stats.symbols},
+            {"lambdas", stats.lambdas},
+            {"frames", stats.frames},
+            {"objects", stats.objects},
+            {"bytes-live", stats.bytesLive},
+            {"peak-bytes-live", stats.peakBytesLive},
+            {"deepest-frame", stats.deepestFrame},
+        };
+        Value list;
+        for (size_t i = sizeof(counts) / sizeof(counts[0]); i-- > 0;) {
+            const Symbol* key = intern(counts[i].first);
+            Value n = make_number(Number((int64_t)counts[i].second));
+            if (key == name) {
+                return n;
+            }
+            list = make_cons(make_cons(Value(key), std::move(n)), std::move(list));
+        }
+        assert(!name);  // one of the counts.
+        return list;
+    }
+};
+
+// (map procedure list)
+class MapProc : public Procedure {
+public:
+    void serialize(std::ostream* o) const override { *o << "map"; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+    Value apply(
+            const Value* args, int count) const override {
+        assert(2 == count);
+        const Procedure* proc = dcastProcedure(args[0]);
+        assert(proc);
+        std::vector<Value> results;
+        for (const Cons* c = dcastCons(args[1]); c; c = dcastCons(c->right)) {
+            results.push_back(proc->apply(&c->left, 1));
+        }
+        Value list;
+        for (auto i = results.rbegin(); i != results.rend(); ++i) {
+            list = make_cons(std::move(*i), std::move(list));
+        }
+        return list;
+    }
+};
+
+// A function compiled ahead of time by dissemblance-aot.
+struct CompiledFunction {
+    const char* name;
+    int arity;
+    Value (*function)(const Value* args);
+};
+
+// Those linked into this program, registered before main().
+std::vector<CompiledFunction>& compiled_functions() {
+    static std::vector<CompiledFunction> functions;
+    return functions;
+}
+
+class CompiledProc : public Procedure {
+    CompiledFunction compiled;
+public:
+    CompiledProc(CompiledFunction c) : compiled(c) {}
+    void serialize(std::ostream* o) const override { *o << compiled.name; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+    Value apply(
+            const Value* args, int count) const override {
+        assert(count == compiled.arity);
+        return compiled.function(args);
     }
 };
 
@@ -586,82 +1204,239 @@ struct NumberOps {
 
 }  // namespace
 ////////////////////////////////////////////////////////////////////////////////
+
+void dissemblance::LambdaProc::serialize(std::ostream* o) const {
+    // (lambda parameters . body)
+    Expression::Serialize(
+            make_cons(Value(intern("lambda")), make_cons(code->parameters, code->body)), o);
+}
+
+Value dissemblance::LambdaProc::eval(
+        const Value& arguments,
+        Ref<Env>& env) const {
+    return eval_tail(this, arguments, env);
+}
+
+Value dissemblance::LambdaProc::tailEval(
+        const Value& arguments,
+        Ref<Env>& env,
+        Tail* tail) const {
+    auto frame = this->frame();
+    int index = 0;
+    const Value* rest = &arguments;
+    for (const Cons* arg; index < code->arity && (arg = dcastCons(*rest)); rest = &arg->right) {
+        frame->slots[index++] = evaluate(arg->left, env);
+    }
+    assert(index == code->arity && !*rest);
+    if (gProfiling) {
+        // The arguments were evaluated in the caller's frame; a call in tail
+        // position replaces it.
+        profile_exit_to(gTailMark);
+        profile_enter(this);
+    }
+    tail->expr = Begin::Beginner(dcastCons(code->running()), frame);
+    tail->env = std::move(frame);
+    return nullptr;
+}
+
+Value dissemblance::LambdaProc::apply(
+        const Value* args, int count) const {
+    assert(count == code->arity);
+    auto frame = this->frame();
+    std::copy(args, args + count, frame->slots.begin());
+    size_t depth = 0;
+    if (gProfiling) {
+        depth = profile_depth();
+        profile_enter(this);
+    }
+    auto value = evaluate(Begin::Beginner(dcastCons(code->running()), frame), frame);
+    if (gProfiling) {
+        profile_exit_to(depth);
+    }
+    return value;
+}
+
+Value dissemblance::SetLocal::eval(
+        const Value& expr,
+        Ref<Env>& env) const {
+    //            0   1
+    // (set! . (ref (+ b c d))
+    const Value* operands[2];
+    get_items(expr, operands, 2);
+    const LocalRef* ref = dcastLocalRef(*operands[0]);
+    assert(ref);
+    Value& variable = find(env.get(), ref);
+    variable = evaluate(*operands[1], env);
+    if (definition == DefineForm) {
+        name_lambda(variable, ref->symbol);
+    }
+    return nullptr;
+}
+
+Ref<Env> dissemblance::LambdaProc::frame() const {
+    auto frame = Ref<Env>(new Env(environment));
+    frame->code = code;
+    frame->slots.resize(code->variables.size());
+    return frame;
+}
+
+std::shared_ptr<const LambdaCode> dissemblance::resolve_lambda(
+        const Value& expr, Env* env) {
+    return Resolver(env).lambda(expr);
+}
+
 Environment::Environment() = default;
 Environment::~Environment() = default;
 
-void dissemblance::Expression::Serialize(const Expression* expr, std::ostream* o) {
-    if (expr) {
-        expr->serialize(o);
-    } else {
-        *o << "()";
-    }
+void dissemblance::Freeze(Environment& env) {
+    env.impl->frozen = true;
+}
+
+Environment dissemblance::Extend(const Environment& base) {
+    Environment env;
+    env.impl = Ref<Env>(new Env(base.impl));
+    return env;
+}
+
+void dissemblance::Expression::Serialize(const Value& value, std::ostream* o) {
+    Writer(o).write(value);
+}
+
+Value dissemblance::make_quote() {
+    return quote();
+}
+
+Value dissemblance::Parse(const char** begin, const char* end) {
+    assert(begin && *begin);
+    Tokenizer tokenizer(*begin, end);
+    auto expr = Parser().parse(&tokenizer);
+    *begin = tokenizer.position();
+    return expr;
 }
 
-std::shared_ptr<Expression> dissemblance::Parse(std::istream* i) {
+Value dissemblance::Parse(std::istream* i) {
     assert(i);
-    Tokenizer tokenizer(i);
-    return parse_expression(&tokenizer);
+    std::string text;
+    read_expression(i->rdbuf(), &text);
+    const char* begin = text.data();
+    return Parse(&begin, begin + text.size());
 }
 
-static std::shared_ptr<Expression> evaluate(
-        const std::shared_ptr<Expression>& expr,
-        std::shared_ptr<Env>& env) {
-    if (!expr) {
-        return nullptr;  // special case
-    }
-    if (const Symbol* symbol = dcastSymbol(expr)) {
-        std::shared_ptr<Expression>* ptr = find(env.get(), symbol->name);
-        if (!ptr) {
-            std::cerr << "missing symbol: '" << symbol->name << "'.  :(\n";
+Value dissemblance::evaluate(
+        const Value& expression,
+        Ref<Env>& environment) {
+    const Value* expr = &expression;
+    Ref<Env>* env = &environment;
+    // After a tail call, these hold what `expr` and `env` point to.
+    Procedure::Tail current;
+    ProfileMark mark;
+    while (true) {
+        safe_point();
+        if (!*expr) {
+            return nullptr;  // special case
+        }
+        if (const LocalRef* ref = dcastLocalRef(*expr)) {
+            return find(env->get(), ref);
+        }
+        if (const GlobalRef* ref = dcastGlobalRef(*expr)) {
+            Value* ptr = find(env->get(), ref);
+            if (!ptr) {
+                std::cerr << "missing symbol: '" << ref->symbol->name << "'.  :(\n";
+            }
+            assert(ptr);
+            return load_global(ptr);
+        }
+        if (const Symbol* symbol = dcastSymbol(*expr)) {
+            Value* ptr = find(env->get(), symbol);
+            if (!ptr) {
+                std::cerr << "missing symbol: '" << symbol->name << "'.  :(\n";
+            }
+            assert(ptr);
+            return load_global(ptr);
+        }
+        const Cons* cons = dcastCons(*expr);
+        if (!cons) {
+            return *expr;  // e. g. number;
+        }
+        auto x = evaluate(cons->left, *env);
+        const Procedure* proc = dcastProcedure(x);
+        if (!proc) {
+            Expression::Serialize(x, &std::cerr);
+            std::cerr << '\n';
+            assert(false);
+        }
+        assert(proc);
+        Procedure::Tail tail;
+        Value value;
+        if (gProfiling && !proc->asLambdaProc() && proc->form() != Procedure::Application) {
+            // A special form's call ends when it returns, even if it leaves
+            // an expression to evaluate in its place.  Other builtins are
+            // counted by eval_apply().
+            size_t depth = profile_depth();
+            profile_enter(proc);
+            value = proc->tailEval(cons->right, *env, &tail);
+            profile_exit_to(depth);
+        } else {
+            value = proc->tailEval(cons->right, *env, &tail);
+        }
+        if (!tail.expr) {
+            return value;
+        }
+        current.expr = std::move(tail.expr);
+        expr = &current.expr;
+        if (tail.env) {
+            current.env = std::move(tail.env);
+            env = &current.env;
         }
-        assert(ptr);
-        return *ptr;
-    }
-    const Cons* cons = dcastCons(expr);
-    if (!cons) {
-        return expr;  // e. g. number;
-    }
-    auto x = evaluate(cons->left, env);
-    const Procedure* proc = x->asProcedure();
-    if (!proc) {
-        Expression::Serialize(x.get(), &std::cerr);
-        std::cerr << '\n';
-        assert(false);
     }
-    assert(proc);
-    return proc->eval(cons->right, env);
 }
 
-std::shared_ptr<Expression> dissemblance::Eval(
-        const std::shared_ptr<Expression>& expr,
+Value dissemblance::Eval(
+        const Value& expr,
         Environment& env) {
     return evaluate(expr, env.impl);
 }
 
 dissemblance::Environment dissemblance::CoreEnvironemnt() {
     Environment env;
-    env.impl = std::make_shared<Env>();
+    env.impl = Ref<Env>(new Env);
     auto& map = env.impl->map;
-    map["if"] = std::make_shared<If>();
-    map["define"] = std::make_shared<Define>();
-    map["set!"] = std::make_shared<Set>();
-    map["quote"] = quote();
-    map["+"] = std::make_shared<Accumulate<NumberOps::Add, 0> >("+");
-    map["*"] = std::make_shared<Accumulate<NumberOps::Multiply, 1> >("*");
-    map["-"] = std::make_shared<Subtract>();
-    map["begin"] = std::make_shared<Begin>();
-    map["lambda"] = std::make_shared<Lambda>();
-    map["cons"] = std::make_shared<ConsProc>();
-    map["car"] = std::make_shared<CarProc>();
-    map["cdr"] = std::make_shared<CdrProc>();
-    map["list"] = std::make_shared<List>();
-    map["/"] = std::make_shared<BinaryOperation<NumberOps::Divide> >("/");
-    map["="] = std::make_shared<ComparisonOperation<NumberOps::Equal> >("=");
-    map["!="] = std::make_shared<ComparisonOperation<NumberOps::NotEqual> >("!=");
-    map["<"] = std::make_shared<ComparisonOperation<NumberOps::LessThan> >("<");
-    map[">"] = std::make_shared<ComparisonOperation<NumberOps::GreaterThan> >(">");
-    map["<="] = std::make_shared<ComparisonOperation<NumberOps::LessEq> >("<=");
-    map[">="] = std::make_shared<ComparisonOperation<NumberOps::GreaterEq> >(">=");
-    return std::move(env);
+    ++gGlobalVersion;
+    map[intern("if")] = Value(new If);
+    map[intern("define")] = Value(new Define);
+    map[intern("set!")] = Value(new Set);
+    map[intern("quote")] = quote();
+    map[intern("+")] = Value(new Accumulate<NumberOps::Add, Number::Add, 0>("+"));
+    map[intern("*")] = Value(new Accumulate<NumberOps::Multiply, Number::Multiply, 1>("*"));
+    map[intern("-")] = Value(new Subtract);
+    map[intern("begin")] = Value(new Begin);
+    map[intern("lambda")] = Value(new Lambda);
+    map[intern("cons")] = Value(new ConsProc);
+    map[intern("car")] = Value(new CarProc);
+    map[intern("cdr")] = Value(new CdrProc);
+    map[intern("map")] = Value(new MapProc);
+    map[intern("list")] = Value(new List);
+    map[intern("/")] = Value(new BinaryOperation<NumberOps::Divide>("/"));
+    map[intern("=")] = Value(new ComparisonOperation<NumberOps::Equal>("="));
+    map[intern("!=")] = Value(new ComparisonOperation<NumberOps::NotEqual>("!="));
+    map[intern("<")] = Value(new ComparisonOperation<NumberOps::LessThan>("<"));
+    map[intern(">")] = Value(new ComparisonOperation<NumberOps::GreaterThan>(">"));
+    map[intern("<=")] = Value(new ComparisonOperation<NumberOps::LessEq>("<="));
+    map[intern(">=")] = Value(new ComparisonOperation<NumberOps::GreaterEq>(">="));
+    map[intern("eq?")] = Value(new SamenessProc<identical>("eq?"));
+    map[intern("equal?")] = Value(new SamenessProc<equal>("equal?"));
+    map[intern("heap-stats")] = Value(new HeapStatsProc);
+    add_vector_procedures(env.impl.get());
+    add_hash_table_procedures(env.impl.get());
+    add_parallel_procedures(env.impl.get());
+    for (const CompiledFunction& compiled : compiled_functions()) {
+        map[intern(compiled.name)] = Value(new CompiledProc(compiled));
+    }
+    return env;
+}
+
+bool dissemblance::aot::define(const char* name, int arity, Value (*function)(const Value*)) {
+    compiled_functions().push_back(CompiledFunction{name, arity, function});
+    return true;
 }
 
@@ -4,27 +4,248 @@
 #ifndef dissemblance_DEFINED
 #define dissemblance_DEFINED
 
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <istream>
 #include <memory>
 #include <ostream>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace dissemblance {
 
 struct Cons;
 struct NumberValue;
 struct Symbol;
+struct LocalRef;
+struct GlobalRef;
 struct Procedure;
+struct Program;
 
+class Tracer;
+class Value;
+
+// Whether threads other than the main one may be using Expressions.  Once
+// they may, reference counts are changed atomically.  See parallel.cpp.
+extern bool gThreaded;
+
+// A heap object.  Expressions are reference counted by the Values that
+// refer to them, which frees most of them as soon as they become garbage.
+// Every Expression is also on the heap's list, so that the collector can find
+// the cycles counting never frees, such as a recursive closure and the frame
+// it was defined in.
 class Expression {
 public:
-    static void Serialize(const Expression*, std::ostream*);
-    virtual ~Expression() {}
+    static void Serialize(const Value&, std::ostream*);
+    Expression();
+    virtual ~Expression();
     virtual const Cons* asCons() const { return nullptr; }
     virtual const NumberValue* asNumberValue() const { return nullptr; }
     virtual const Symbol* asSymbol() const { return nullptr; }
+    virtual const LocalRef* asLocalRef() const { return nullptr; }
+    virtual const GlobalRef* asGlobalRef() const { return nullptr; }
     virtual const Procedure* asProcedure() const { return nullptr; }
     virtual void serialize(std::ostream*) const = 0;
+
+    // Passes the collector every Expression this one holds a counted
+    // reference to.  An Expression that misses one is only ever kept alive
+    // too long; one that passes an uncounted reference can be freed too soon.
+    virtual void trace(Tracer*) const {}
+    // Drops those references, to break a garbage cycle.
+    virtual void clear() {}
+
+    // Expressions come from the heap's slabs; see GetAllocatorStats().
+    static void* operator new(size_t);
+    static void operator delete(void*, size_t);
+
+    static void Retain(const Expression* e) {
+        if (!e) {
+            return;
+        }
+        if (gThreaded) {
+            __atomic_add_fetch(&e->refCount, 1, __ATOMIC_RELAXED);
+        } else {
+            ++e->refCount;
+        }
+    }
+    // Retains e unless it has no references left, as when another thread is
+    // about to destroy it.  Returns whether it did.
+    static bool TryRetain(const Expression* e) {
+        if (!gThreaded) {
+            return e->refCount > 0 && ++e->refCount;
+        }
+        int32_t count = __atomic_load_n(&e->refCount, __ATOMIC_RELAXED);
+        while (count > 0) {
+            if (__atomic_compare_exchange_n(&e->refCount, &count, count + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    static void Release(const Expression* e) {
+        if (!e) {
+            return;
+        }
+        if (gThreaded ? 0 == __atomic_sub_fetch(&e->refCount, 1, __ATOMIC_ACQ_REL)
+                      : 0 == --e->refCount) {
+            Destroy(e);
+        }
+    }
+
+    // What GetHeapStats() counts an Expression as.
+    enum class Kind { Other, Cons, Number, Symbol, Lambda, Frame, Count };
+
+protected:
+    explicit Expression(Kind);
+
+private:
+    friend class Heap;
+    // Deletes e, and whatever deleting it frees, without recursion.  An
+    // object another thread allocated is left for that thread to delete.
+    static void Destroy(const Expression* e);
+    mutable int32_t refCount = 0;
+    mutable int32_t collectorCount;  // scratch space for the collector.
+    Expression* prev;  // the heap's list of every Expression.
+    Expression* next;
+    Expression(const Expression&) = delete;
+    Expression& operator=(const Expression&) = delete;
+};
+
+// A Scheme value: (), a number, or a reference to an Expression.
+//
+// Values are NaN-boxed, so that numbers need no allocation.  A double is
+// stored as its own bits.  Integers that fit in 48 bits, pointers, and () are
+// stored in the payload of negative quiet NaNs, a range no double ever uses
+// here because every NaN is stored as the one positive quiet NaN.  Larger
+// integers are boxed in a NumberValue.
+class Value {
+public:
+    Value() : bits(kNil) {}
+    Value(std::nullptr_t) : bits(kNil) {}
+    Value(const Expression* e)
+        : bits(e ? kPointer | reinterpret_cast<uintptr_t>(e) : kNil) { this->ref(); }
+    Value(const Value& v) : bits(v.bits) { this->ref(); }
+    Value(Value&& v) : bits(v.bits) { v.bits = kNil; }
+    ~Value() { this->unref(); }
+    Value& operator=(const Value& v) {
+        v.ref();
+        this->unref();
+        bits = v.bits;
+        return *this;
+    }
+    Value& operator=(Value&& v) {
+        std::swap(bits, v.bits);
+        return *this;
+    }
+
+    static bool FitsInteger(int64_t i) { return -kIntegerLimit <= i && i < kIntegerLimit; }
+    static Value Integer(int64_t i) {
+        Value v;
+        v.bits = kInteger | (static_cast<uint64_t>(i) & kPayload);
+        return v;
+    }
+    static Value Double(double d) {
+        Value v;
+        if (d == d) {
+            memcpy(&v.bits, &d, sizeof(d));
+        } else {
+            v.bits = kCanonicalNaN;
+        }
+        return v;
+    }
+
+    explicit operator bool() const { return bits != kNil; }
+    bool isDouble() const { return bits < kInteger; }
+    bool isInteger() const { return (bits & kTagMask) == kInteger; }
+    double asDouble() const {
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        return d;
+    }
+    int64_t asInteger() const { return static_cast<int64_t>(bits << 16) >> 16; }
+    // The heap object, or nullptr for () and immediate numbers.
+    const Expression* get() const {
+        return (bits & kTagMask) == kPointer
+               ? reinterpret_cast<const Expression*>(bits & kPayload) : nullptr;
+    }
+    // Identity: the same object, or equal immediates.
+    bool operator==(const Value& v) const { return bits == v.bits; }
+    bool operator!=(const Value& v) const { return bits != v.bits; }
+
+private:
+    enum : uint64_t {
+        kTagMask      = 0xFFFF000000000000,
+        kPayload      = 0x0000FFFFFFFFFFFF,
+        kInteger      = 0xFFF9000000000000,
+        kPointer      = 0xFFFA000000000000,
+        kNil          = 0xFFFB000000000000,
+        kCanonicalNaN = 0x7FF8000000000000,
+    };
+    static const int64_t kIntegerLimit = INT64_C(1) << 47;
+    uint64_t bits;
+    void ref() const { Expression::Retain(this->get()); }
+    void unref() const { Expression::Release(this->get()); }
+};
+
+// A counted reference to an Expression of type T.
+template <typename T>
+class Ref {
+public:
+    Ref() : ptr(nullptr) {}
+    Ref(std::nullptr_t) : ptr(nullptr) {}
+    explicit Ref(T* p) : ptr(p) { Expression::Retain(ptr); }
+    Ref(const Ref& r) : ptr(r.ptr) { Expression::Retain(ptr); }
+    Ref(Ref&& r) : ptr(r.ptr) { r.ptr = nullptr; }
+    ~Ref() { Expression::Release(ptr); }
+    Ref& operator=(const Ref& r) {
+        Expression::Retain(r.ptr);
+        Expression::Release(ptr);
+        ptr = r.ptr;
+        return *this;
+    }
+    Ref& operator=(Ref&& r) {
+        std::swap(ptr, r.ptr);
+        return *this;
+    }
+    T* get() const { return ptr; }
+    T* operator->() const { return ptr; }
+    T& operator*() const { return *ptr; }
+    explicit operator bool() const { return ptr != nullptr; }
+
+private:
+    T* ptr;
+};
+
+// Serializes values into a buffer, and writes the buffer to a stream only when
+// it fills or is flushed.  Lists are written without recursion, however
+// deeply they nest.
+class Writer {
+public:
+    explicit Writer(std::ostream*);
+    ~Writer();
+    void write(const Value&);
+    void write(std::string_view);
+    void write(char c) {
+        if (used == buffer.size()) {
+            this->flush();
+        }
+        buffer[used++] = c;
+    }
+    void flush();
+
+private:
+    std::ostream* out;
+    std::vector<char> buffer;
+    size_t used = 0;
+    std::vector<const Cons*> lists;  // those being written, innermost last.
+    void atom(const Value&);
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
 };
 
 class Environment {
@@ -36,14 +257,141 @@ public:
     Environment& operator=(Environment&&);
     Environment& operator=(const Environment&);
     struct Impl;
-    std::shared_ptr<Impl> impl;
+    Ref<Impl> impl;
 };
 
-std::shared_ptr<Expression> Parse(std::istream*);
+// Whether parsing shares structurally equal lists and large integers, as
+// --hash-cons asks.  It may, since nothing changes a cons once it is made.
+extern bool gHashConsing;
+
+// Parses one expression from a stream, reading nothing past its end.
+Value Parse(std::istream*);
+
+// Parses the next expression in [*begin, end), without copying the buffer,
+// and moves *begin past it.  Either returns () at the end of the input.
+Value Parse(const char** begin, const char* end);
+
+// Parses all of `text`.  With a `cache` directory, also keeps a binary
+// encoding of the expressions there, named for a hash of the text, which a
+// later call with the same text reads back instead of parsing.  A missing,
+// stale or damaged encoding is replaced.
+std::vector<Value> ParseAll(std::string_view text, const char* cache = nullptr);
 
 Environment CoreEnvironemnt();
 
-std::shared_ptr<Expression> Eval(const std::shared_ptr<Expression>&, Environment&);
+// Makes env's bindings permanent: neither `define` nor `set!` may change them
+// again, so environments on many threads can share it without locking.
+void Freeze(Environment&);
+
+// A new, empty environment for top-level definitions, in front of `base`.
+Environment Extend(const Environment& base);
+
+// Writes `env` and everything it refers to into an image at `path`, which
+// LoadImage() can make a copy of in a later run without evaluating anything.
+// Returns false, with errno set, if the file could not be written, or if
+// `env` refers to what can not be saved, such as a future.
+bool SaveImage(const Environment& env, const char* path);
+
+// Sets *env to a copy of the environment saved at `path`, whose builtins are
+// those of a new CoreEnvironemnt().  Returns false, with errno set, if the file
+// could not be read or is not an image.
+bool LoadImage(const char* path, Environment* env);
+
+Value Eval(const Value&, Environment&);
+
+// Compiles an expression to bytecode for Run().  Special forms are recognized
+// by what their names are bound to in the environment at compile time.
+std::shared_ptr<const Program> Compile(const Value&, Environment&);
+
+// Runs compiled bytecode, in the environment it was compiled for; produces the
+// same value as Eval() would have.
+Value Run(const std::shared_ptr<const Program>&, Environment&);
+
+struct CollectorStats {
+    uint64_t collections = 0;
+    uint64_t objectsFreed = 0;  // by the collector, not by reference counting.
+    uint64_t liveObjects = 0;
+    std::chrono::nanoseconds totalPause{0};
+    std::chrono::nanoseconds longestPause{0};
+};
+
+CollectorStats GetCollectorStats();
+
+// Expressions are allocated from 64 KiB slabs, one size class per multiple of
+// 16 bytes.  A slab is returned to the system as soon as all of its objects
+// are freed, unless it is the last slab of its size class with room.
+struct AllocatorStats {
+    struct SizeClass {
+        size_t objectSize = 0;
+        uint64_t slabs = 0;
+        uint64_t liveObjects = 0;
+        uint64_t allocations = 0;
+    };
+    std::vector<SizeClass> sizeClasses;  // those that were ever used.
+    uint64_t slabs = 0;
+    uint64_t peakSlabs = 0;
+    uint64_t slabsReleased = 0;
+    uint64_t largeAllocations = 0;  // objects too large for any size class.
+    uint64_t bytesInUse = 0;  // by live objects in slabs.
+};
+
+AllocatorStats GetAllocatorStats();
+
+// What the interpreter has made, counted by each thread as it allocates, so
+// cheaply that the counts are always kept.  The peak is the sum of each
+// thread's own, so exact for one thread and at most that for several.
+struct HeapStats {
+    uint64_t conses = 0;   // made, whether freed since or not.
+    uint64_t numbers = 0;  // integers too large to be immediate.
+    uint64_t symbols = 0;
+    uint64_t lambdas = 0;  // closures.
+    uint64_t frames = 0;   // environments: top levels and calls' frames.
+    uint64_t objects = 0;  // Expressions of every kind.
+    uint64_t bytesLive = 0;
+    uint64_t peakBytesLive = 0;
+    uint64_t deepestFrame = 0;  // the most frames out from one to its top level.
+};
+
+HeapStats GetHeapStats();
+
+// Counts calls of each procedure, and the time spent in them, by both Eval()
+// and Run(), until the program ends.  Lambdas are known by the name they were
+// first defined as.
+void StartProfiling();
+
+// Writes a flat profile of lambdas, one of builtins, and a call tree.
+void WriteProfile(std::ostream*);
+
+// Evaluates many scripts at once on a pool of threads.  Each script runs in
+// an environment of its own, over one frozen core environment, and its output
+// is handed on in the order the scripts were submitted.  See server.cpp.
+class BatchServer {
+public:
+    struct Stats {
+        uint64_t requests = 0;
+        std::chrono::nanoseconds elapsed{0};  // from construction to finish().
+        // From submission to output, of each script in turn.
+        std::vector<std::chrono::nanoseconds> latencies;
+    };
+    // `output` is called with each script's printed values, one at a time and
+    // in order, on whichever thread finished it.
+    BatchServer(Environment core, int threads, bool vm,
+                std::function<void(std::string_view)> output);
+    ~BatchServer();
+    void submit(std::string script);
+    // Waits for every script submitted to finish.
+    Stats finish();
+
+    struct Impl;
+private:
+    std::unique_ptr<Impl> impl;
+    BatchServer(const BatchServer&) = delete;
+    BatchServer& operator=(const BatchServer&) = delete;
+};
+
+// Frees every unreachable cycle now.  Eval() and Run() also collect on their
+// own, once enough has been allocated since the last collection.
+void CollectGarbage();
 
 }
 
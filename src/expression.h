@@ -0,0 +1,501 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// The interpreter's object model, shared by the tree-walking evaluator in
+// dissemblance.cpp and the bytecode compiler in vm.cpp.
+
+#ifndef expression_DEFINED
+#define expression_DEFINED
+
+#include "dissemblance.h"
+#include "number.h"
+
+#include <atomic>
+#include <cassert>
+#include <unordered_map>
+#include <vector>
+
+namespace dissemblance {
+
+struct LambdaCode;
+
+// Receives the references an Expression reports from trace().
+class Tracer {
+public:
+    virtual void visit(const Expression*) = 0;
+    void trace(const Value& v) {
+        if (const Expression* e = v.get()) {
+            this->visit(e);
+        }
+    }
+    template <typename T>
+    void trace(const Ref<T>& r) {
+        if (r) {
+            this->visit(r.get());
+        }
+    }
+};
+
+// Allocations by the main thread left before the collector next runs.
+extern std::atomic<int64_t> gAllocationsUntilCollection;
+
+// Collects garbage if enough has been allocated.  Call only where every
+// object still in use is held by a counted reference.
+inline void safe_point() {
+    if (gAllocationsUntilCollection.load(std::memory_order_relaxed) <= 0) {
+        CollectGarbage();
+    }
+}
+
+// Held by a thread for as long as it runs a task of the thread pool; the
+// collector does not run at the same time as any task.
+class RunningTask {
+public:
+    RunningTask();
+    ~RunningTask();  // also deletes what other threads released last.
+};
+
+// The profiler's hooks.  While it is off, they are never called.
+extern bool gProfiling;
+size_t profile_depth();
+void profile_enter(const Procedure*);
+// Ends the calls begun since the profiler was `depth` calls deep.
+void profile_exit_to(size_t depth);
+
+// How deep the profiler was when the innermost evaluate() began.  A lambda
+// called in tail position ends the calls its evaluate() has begun since.
+extern size_t gTailMark;
+
+// Sets gTailMark for the life of an evaluate(), and ends its calls.
+class ProfileMark {
+    bool active;
+    size_t mark;
+    size_t outer;
+public:
+    ProfileMark() : active(gProfiling) {
+        if (active) {
+            outer = gTailMark;
+            mark = gTailMark = profile_depth();
+        }
+    }
+    ~ProfileMark() {
+        if (active) {
+            profile_exit_to(mark);
+            gTailMark = outer;
+        }
+    }
+};
+
+using Env = Environment::Impl;
+
+// Frames are heap objects too, since closures and frames refer to each other.
+struct Environment::Impl : public Expression {
+    explicit Impl(Ref<Environment::Impl> o = nullptr);
+    Ref<Environment::Impl> outer;
+    // Top-level bindings, keyed on interned symbols, so lookup is a pointer hash.
+    std::unordered_map<const Symbol*, Value> map;
+    // A lambda call frame instead has one slot per variable of `code`.
+    std::vector<Value> slots;
+    std::shared_ptr<const LambdaCode> code;
+    bool frozen = false;  // see Freeze().
+    uint32_t depth;  // the frames out to the top level.
+
+    void serialize(std::ostream* o) const override { *o << "#<environment>"; }
+    void trace(Tracer* t) const override {
+        t->trace(outer);
+        for (const auto& binding : map) {
+            t->trace(binding.second);
+        }
+        for (const Value& v : slots) {
+            t->trace(v);
+        }
+    }
+    void clear() override {
+        outer = nullptr;
+        map.clear();
+        slots.clear();
+    }
+};
+
+Value evaluate(
+        const Value& expr,
+        Ref<Env>& env);
+
+inline const Cons* dcastCons(const Value& u) {
+    const Expression* e = u.get();
+    return e ? e->asCons() : nullptr;
+}
+inline const Symbol* dcastSymbol(const Value& u) {
+    const Expression* e = u.get();
+    return e ? e->asSymbol() : nullptr;
+}
+inline const NumberValue* dcastNumberValue(const Value& u) {
+    const Expression* e = u.get();
+    return e ? e->asNumberValue() : nullptr;
+}
+inline const LocalRef* dcastLocalRef(const Value& u) {
+    const Expression* e = u.get();
+    return e ? e->asLocalRef() : nullptr;
+}
+inline const GlobalRef* dcastGlobalRef(const Value& u) {
+    const Expression* e = u.get();
+    return e ? e->asGlobalRef() : nullptr;
+}
+inline const Procedure* dcastProcedure(const Value& u) {
+    const Expression* e = u.get();
+    return e ? e->asProcedure() : nullptr;
+}
+
+// An integer too large to be stored in a Value.
+struct NumberValue : public Expression {
+    Number value;
+    NumberValue(Number v) : Expression(Kind::Number), value(v) {}
+    const NumberValue* asNumberValue() const override { return this; }
+    void serialize(std::ostream* o) const override {
+        return value.serialize(o);
+    }
+};
+
+inline Value make_number(Number n) {
+    if (!n.isInt()) {
+        return Value::Double(n.asDouble());
+    }
+    if (Value::FitsInteger(n.asInt())) {
+        return Value::Integer(n.asInt());
+    }
+    return Value(new NumberValue(n));
+}
+
+inline bool is_number(const Value& v) {
+    return v.isInteger() || v.isDouble() || dcastNumberValue(v);
+}
+
+inline Number to_number(const Value& v) {
+    if (v.isInteger()) {
+        return Number(v.asInteger());
+    }
+    if (v.isDouble()) {
+        return Number(v.asDouble());
+    }
+    const NumberValue* nv = dcastNumberValue(v);
+    assert(nv);  // is a number
+    return nv->value;
+}
+
+struct Symbol : public Expression {
+    const std::string name;
+    // Whether a call of what it names was folded into a constant.
+    mutable std::atomic<bool> folded{false};
+    Symbol(const std::string& n) : Expression(Kind::Symbol), name(n) {}
+    const Symbol* asSymbol() const override { return this; }
+    void serialize(std::ostream* o) const override { *o << name; }
+};
+
+// Every symbol with a given name is the same object, so symbols can be
+// compared and hashed by address.  Interned symbols are never freed.
+const Symbol* intern(std::string_view name);
+
+struct Cons : public Expression {
+    Value left;
+    Value right;
+    Cons(Value l, Value r)
+        : Expression(Kind::Cons), left(std::move(l)), right(std::move(r)) {}
+    const Cons* asCons() const override { return this; }
+    void trace(Tracer* t) const override {
+        t->trace(left);
+        t->trace(right);
+    }
+    void clear() override {
+        left = nullptr;
+        right = nullptr;
+    }
+    void serialize(std::ostream* o) const override {
+        Expression::Serialize(Value(this), o);
+    }
+};
+
+// A reference to a lambda's variable, resolved when the lambda was created
+// to a slot in the frame `depth` links out along the environment chain.
+struct LocalRef : public Expression {
+    const Symbol* symbol;
+    int depth;
+    int slot;
+    LocalRef(const Symbol* s, int d, int i) : symbol(s), depth(d), slot(i) {}
+    const LocalRef* asLocalRef() const override { return this; }
+    void serialize(std::ostream* o) const override { symbol->serialize(o); }
+};
+
+// Incremented whenever a binding is added that shadows one in an outer
+// environment, or the bindings are replaced wholesale.
+extern std::atomic<uint64_t> gGlobalVersion;
+
+// Set once a global whose calls were folded is set or defined again, after
+// which lambdas run their bodies unfolded.
+extern std::atomic<bool> gFoldsStale;
+
+// A reference to a top-level binding, from a resolved body or compiled code,
+// which caches where the binding was found.  A binding stays where it is once
+// added, so `set!` leaves the cache valid; only a new binding, which might
+// shadow it, makes the cache stale.  Threads may race to fill the cache, but
+// all fill it alike.
+struct GlobalRef : public Expression {
+    const Symbol* symbol;
+    mutable std::atomic<Value*> binding{nullptr};
+    mutable std::atomic<uint64_t> version{0};  // when `binding` was found.
+    GlobalRef(const Symbol* s) : symbol(s) {}
+    const GlobalRef* asGlobalRef() const override { return this; }
+    void serialize(std::ostream* o) const override { symbol->serialize(o); }
+};
+
+inline Value make_cons(Value l, Value r) {
+    return Value(new Cons(std::move(l), std::move(r)));
+}
+
+struct LambdaProc;
+
+struct Procedure : public Expression {
+public:
+    // Special forms, whose operands are not simply evaluated in order.
+    enum Form {
+        Application,
+        QuoteForm,
+        LambdaForm,
+        DefineForm,
+        SetForm,
+        IfForm,
+        BeginForm,
+    };
+    Procedure() = default;
+    const Procedure* asProcedure() const override { return this; }
+    virtual const LambdaProc* asLambdaProc() const { return nullptr; }
+    virtual Form form() const { return Application; }
+    virtual Value eval(
+            const Value& expr,
+            Ref<Env>& env) const = 0;
+
+    // The expression left for the caller to evaluate, and the environment
+    // to evaluate it in if that is not the caller's.
+    struct Tail {
+        Value expr;
+        Ref<Env> env;
+    };
+    // Like eval(), but a procedure whose value is that of its last
+    // expression may instead return that expression in `tail`, so that
+    // evaluate() runs calls in tail position without growing the C++ stack.
+    virtual Value tailEval(
+            const Value& expr,
+            Ref<Env>& env,
+            Tail*) const {
+        return this->eval(expr, env);
+    }
+
+    // Procedures that evaluate all of their operands can also be applied to
+    // `count` already-evaluated arguments.
+    virtual Value apply(
+            const Value* args, int count) const;
+
+    // Whether apply() can be called on these constant arguments once, when a
+    // lambda is created, in place of each call: it has no effects and cannot
+    // fail.
+    virtual bool foldable(const Value*, int) const { return false; }
+
+protected:
+    explicit Procedure(Kind kind) : Expression(kind) {}
+};
+
+// The part of a lambda that does not depend on the environment it closes
+// over: its variables (parameters, then internal defines) and its body, in
+// which every reference to a variable of this or an enclosing lambda has been
+// replaced with a LocalRef.
+struct LambdaCode {
+    Value parameters;  // as written.
+    int arity;
+    std::vector<const Symbol*> variables;
+    Value body;  // list of forms.
+    Value unfolded;  // the same, without folding, if anything was folded.
+    // The body, and then `unfolded`, compiled to bytecode the first time the
+    // VM needs it, by whichever thread gets there first; see compiled() in
+    // vm.cpp.
+    mutable std::atomic<const Program*> program[2] = {};
+    mutable std::shared_ptr<const Program> compiled[2];  // owns `program`.
+    // The variable the lambda was first defined as, for the profiler.
+    mutable std::atomic<const Symbol*> name{nullptr};
+    mutable const Symbol* profileName = nullptr;  // otherwise.
+
+    // Whether to run `unfolded`, since what was folded may not be the same now.
+    bool stale() const {
+        return unfolded && gFoldsStale.load(std::memory_order_relaxed);
+    }
+    const Value& running() const { return this->stale() ? unfolded : body; }
+};
+
+struct LambdaProc : public Procedure {
+    const std::shared_ptr<const LambdaCode> code;
+    Ref<Env> environment;
+    LambdaProc(std::shared_ptr<const LambdaCode> c, const Ref<Env>& env)
+        : Procedure(Kind::Lambda), code(std::move(c)), environment(env) {}
+    const LambdaProc* asLambdaProc() const override { return this; }
+    void trace(Tracer* t) const override { t->trace(environment); }
+    void clear() override { environment = nullptr; }
+    void serialize(std::ostream* o) const override;
+    Value eval(
+            const Value& arguments,
+            Ref<Env>& env) const override;
+    Value tailEval(
+            const Value& arguments,
+            Ref<Env>& env,
+            Tail* tail) const override;
+    Value apply(
+            const Value* args, int count) const override;
+
+private:
+    // A frame for a call, with the arguments still to be filled in.
+    Ref<Env> frame() const;
+};
+
+// Stands in for `lambda` in an already-resolved body.
+struct MakeClosure : public Procedure {
+    const std::shared_ptr<const LambdaCode> code;
+    MakeClosure(std::shared_ptr<const LambdaCode> c) : code(std::move(c)) {}
+    void serialize(std::ostream* o) const override { *o << "lambda"; }
+    Form form() const override { return LambdaForm; }
+    Value eval(
+            const Value&,
+            Ref<Env>& env) const override {
+        return Value(new LambdaProc(code, env));
+    }
+};
+
+// Stands in for `define` or `set!` of a local variable in a resolved body.
+struct SetLocal : public Procedure {
+    const Form definition;  // DefineForm or SetForm.
+    SetLocal(Form f) : definition(f) {}
+    void serialize(std::ostream* o) const override {
+        *o << (definition == DefineForm ? "define" : "set!");
+    }
+    Form form() const override { return definition; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override;
+};
+
+// Names the lambda `value` after `variable`, if it is a lambda not yet named.
+inline void name_lambda(const Value& value, const Symbol* variable) {
+    const Procedure* proc = dcastProcedure(value);
+    const LambdaProc* lambda = proc ? proc->asLambdaProc() : nullptr;
+    if (lambda && !lambda->code->name) {
+        lambda->code->name = variable;
+    }
+}
+
+// Resolves the variables of (lambda . expr) created in `env`.
+std::shared_ptr<const LambdaCode> resolve_lambda(
+        const Value& expr, Env* env);
+
+// eval() for procedures that evaluate all of their operands.
+Value eval_apply(
+        const Procedure* proc,
+        const Value& expr,
+        Ref<Env>& env);
+
+// Binds the numeric vector procedures, from vector.cpp, in `env`.
+void add_vector_procedures(Env* env);
+
+// Binds the hash table procedures, from hashtable.cpp, in `env`.
+void add_hash_table_procedures(Env* env);
+
+// Whether `e` is a hash table, and if so, its entries.  For images, which
+// hold tables as their entries.
+bool hash_table_entries(const Expression* e, std::vector<std::pair<Value, Value>>* entries);
+Value make_hash_table();
+void hash_table_set(const Value& table, Value key, Value value);
+
+// Whether `e` is a numeric vector, and if so, its elements, which are doubles
+// or else int64_ts.  For images, which hold vectors' elements as they are.
+bool vector_contents(const Expression* e, bool* isDouble, const void** data, size_t* size);
+Value make_vector(bool isDouble, const void* data, size_t size);
+
+// Binds future, touch and pmap, from parallel.cpp, in `env`.
+void add_parallel_procedures(Env* env);
+
+Value* find(Env* env, const Symbol* s);
+
+// The binding `(set! s ...)` stores to, which must not be in a frozen
+// environment.
+Value* assign(Env* env, const Symbol* s);
+
+// Adds a binding of `symbol`, which must be new, to the map of `env`, which
+// must not be frozen.
+Value& define(Env* env, const Symbol* symbol);
+
+inline Value& find(Env* env, int depth, int slot) {
+    for (; depth > 0; --depth) {
+        env = env->outer.get();
+    }
+    assert(env && slot < (int)env->slots.size());
+    return env->slots[slot];
+}
+
+inline Value& find(Env* env, const LocalRef* ref) {
+    return find(env, ref->depth, ref->slot);
+}
+
+// Lambda frames never have named bindings, so every frame of a chain finds a
+// global in the same place, and one cache serves every call of a lambda.
+// A missing binding is looked for again every time, so that a thread filling
+// the cache late with a miss can not hide a binding added since.
+inline Value* find(Env* env, const GlobalRef* ref) {
+    uint64_t version = gGlobalVersion.load(std::memory_order_acquire);
+    if (ref->version.load(std::memory_order_acquire) == version) {
+        if (Value* binding = ref->binding.load(std::memory_order_relaxed)) {
+            return binding;
+        }
+    }
+    Value* binding = find(env, ref->symbol);
+    ref->binding.store(binding, std::memory_order_relaxed);
+    ref->version.store(version, std::memory_order_release);
+    return binding;
+}
+
+// Reads and sets a top-level binding, which other threads may be reading and
+// setting too: copying a Value, or replacing one, is not atomic, and a
+// thread copying the old value as it is released would find it freed.  Once
+// threads may be running, each holds one of a few locks, picked by the
+// binding's address.  The old value is released after the lock is.
+Value load_global(const Value* binding);
+void store_global(Value* binding, Value value);
+
+int length(const Value& expr, int accumulator = 0);
+
+const Value& get_item(
+        const Value& expr, int index);
+
+// Points items[0..count) at the elements of `expr`, which must be a list of
+// exactly `count`, in one walk down it.  Special forms take their operands so.
+void get_items(
+        const Value& expr, const Value** items, int count);
+
+const Symbol* get_symbol(const Value& expr);
+
+// The `quote` the parser puts in front of an expression after an apostrophe.
+Value make_quote();
+
+// The one shared cons of `left` and `right`, made if there is none yet.
+// Shared conses are only shared with each other if their parts are shared
+// or atoms, so lists are built from their ends.
+Value hash_cons(Value left, Value right);
+
+// make_number(), with integers too large to be immediate shared.
+Value hash_number(Number n);
+
+// A hash of a value's structure, the same for values that are equal().
+// Shared conses keep theirs, so hashing one takes constant time.
+uint64_t structural_hash(const Value&);
+
+// Whether two values have the same structure, as Scheme's equal? does.  Two
+// shared conses are only equal if they are the same cons.
+bool equal(const Value&, const Value&);
+
+}  // namespace dissemblance
+
+#endif  // expression_DEFINED
@@ -0,0 +1,349 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// A cache of parsed source files, in a binary encoding that is faster to
+// read back than the text is to parse.
+//
+// An encoding is a header of five 64-bit words: kMagic, kVersion, the hash
+// and size of the text it was parsed from, and its own size; then the symbols, each a varint length
+// and the name; then the number of expressions, and the expressions, as
+// operations on a stack of values:
+//
+//     kNil                         push ()
+//     kInteger   zigzag varint     push an integer
+//     kDouble    8 bytes           push a double
+//     kSymbol    varint            push the symbol with that index
+//     kQuote                       push the shared `quote`, for an apostrophe
+//     kList      varint n          pop n values, push the list of them
+//     kDotted    varint n          pop n values and a final cdr, push the list
+//
+// Each list's elements come before it, so a value is read without recursion
+// however deeply lists nest, and what is left on the stack at the end is the
+// file's expressions, in order.
+
+#include "dissemblance.h"
+#include "expression.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace dissemblance;
+
+namespace {
+
+const uint64_t kMagic = 0x4C5341464D534944;  // "DISMFASL" in little-endian.
+const uint64_t kVersion = 1;
+const size_t kHeaderWords = 5;
+
+enum Op : uint8_t { kNil, kInteger, kDouble, kSymbol, kQuote, kList, kDotted };
+
+// FNV-1a, over eight bytes at a time, since every load hashes the whole text.
+uint64_t hash(std::string_view text) {
+    const uint64_t kPrime = 0x100000001B3;
+    uint64_t h = 0xCBF29CE484222325;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= text.size(); i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, text.data() + i, sizeof(word));
+        h = (h ^ word) * kPrime;
+        h ^= h >> 29;
+    }
+    for (; i < text.size(); ++i) {
+        h = (h ^ (uint8_t)text[i]) * kPrime;
+    }
+    return h;
+}
+
+class Encoder {
+    std::string ops;
+    std::unordered_map<const Symbol*, uint64_t> symbolIndex;
+    std::vector<const Symbol*> symbols;
+    uint64_t expressions = 0;
+
+    static void varint(std::string* out, uint64_t n) {
+        while (n >= 0x80) {
+            out->push_back((char)(n | 0x80));
+            n >>= 7;
+        }
+        out->push_back((char)n);
+    }
+    void op(Op o) { ops.push_back((char)o); }
+    void op(Op o, uint64_t n) {
+        ops.push_back((char)o);
+        varint(&ops, n);
+    }
+
+    void atom(const Value& value) {
+        if (!value) {
+            this->op(kNil);
+        } else if (const Symbol* symbol = dcastSymbol(value)) {
+            auto i = symbolIndex.emplace(symbol, symbols.size());
+            if (i.second) {
+                symbols.push_back(symbol);
+            }
+            this->op(kSymbol, i.first->second);
+        } else if (is_number(value) && to_number(value).isInt()) {
+            int64_t n = to_number(value).asInt();
+            this->op(kInteger, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+        } else if (is_number(value)) {
+            double d = to_number(value).asDouble();
+            this->op(kDouble);
+            ops.append(reinterpret_cast<const char*>(&d), sizeof(d));
+        } else {
+            const Procedure* proc = dcastProcedure(value);
+            assert(proc && proc->form() == Procedure::QuoteForm);  // all a parse makes.
+            this->op(kQuote);
+        }
+    }
+
+public:
+    // Encodes each of a list's elements, then the list, without recursion.
+    void expression(const Value& expr) {
+        ++expressions;
+        struct Open {
+            const Cons* cell;  // the next element's.
+            const Value* tail;  // a final cdr other than (), still to encode.
+            uint64_t count;
+            bool dotted;
+        };
+        std::vector<Open> stack;
+        const Value* next = &expr;
+        while (true) {
+            if (next) {
+                if (const Cons* cons = dcastCons(*next)) {
+                    stack.push_back(Open{cons, nullptr, 0, false});
+                } else {
+                    this->atom(*next);
+                }
+                next = nullptr;
+            }
+            if (stack.empty()) {
+                return;
+            }
+            Open& open = stack.back();
+            if (open.cell) {
+                next = &open.cell->left;
+                ++open.count;
+                const Value& right = open.cell->right;
+                open.cell = dcastCons(right);
+                if (!open.cell && right) {
+                    open.tail = &right;
+                }
+            } else if (open.tail) {
+                next = open.tail;
+                open.tail = nullptr;
+                open.dotted = true;
+            } else {
+                this->op(open.dotted ? kDotted : kList, open.count);
+                stack.pop_back();
+            }
+        }
+    }
+
+    std::string finish(std::string_view text) {
+        std::string out(sizeof(uint64_t[kHeaderWords]), '\0');
+        varint(&out, symbols.size());
+        for (const Symbol* symbol : symbols) {
+            varint(&out, symbol->name.size());
+            out += symbol->name;
+        }
+        varint(&out, expressions);
+        out += ops;
+        uint64_t header[kHeaderWords] = {kMagic, kVersion, hash(text), text.size(), out.size()};
+        memcpy(&out[0], header, sizeof(header));
+        return out;
+    }
+};
+
+class Decoder {
+    const uint8_t* cursor;
+    const uint8_t* end;
+
+    bool varint(uint64_t* n) {
+        *n = 0;
+        for (int shift = 0; shift < 64 && cursor < end; shift += 7) {
+            uint8_t byte = *cursor++;
+            *n |= (uint64_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    Decoder(std::string_view data)
+        : cursor(reinterpret_cast<const uint8_t*>(data.data()))
+        , end(cursor + data.size()) {}
+
+    // Returns false unless `data` is a whole encoding of `text`.
+    bool decode(std::string_view text, std::vector<Value>* expressions) {
+        uint64_t header[kHeaderWords];
+        if ((size_t)(end - cursor) < sizeof(header)) {
+            return false;
+        }
+        memcpy(header, cursor, sizeof(header));
+        cursor += sizeof(header);
+        if (header[0] != kMagic || header[1] != kVersion || header[3] != text.size() ||
+            header[4] != (uint64_t)(end - cursor) + sizeof(header) || header[2] != hash(text)) {
+            return false;
+        }
+        uint64_t count;
+        if (!this->varint(&count) || count > (uint64_t)(end - cursor)) {
+            return false;
+        }
+        std::vector<const Symbol*> symbols(count);
+        for (const Symbol*& symbol : symbols) {
+            uint64_t length;
+            if (!this->varint(&length) || length > (uint64_t)(end - cursor)) {
+                return false;
+            }
+            symbol = intern(std::string_view(reinterpret_cast<const char*>(cursor), length));
+            cursor += length;
+        }
+        if (!this->varint(&count)) {
+            return false;
+        }
+        std::vector<Value>& stack = *expressions;
+        stack.clear();
+        while (cursor < end) {
+            uint64_t n = 0;
+            switch (*cursor++) {
+                case kNil:
+                    stack.emplace_back();
+                    break;
+                case kInteger: {
+                    if (!this->varint(&n)) {
+                        return false;
+                    }
+                    Number number((int64_t)(n >> 1) ^ -(int64_t)(n & 1));
+                    stack.push_back(gHashConsing ? hash_number(number) : make_number(number));
+                    break;
+                }
+                case kDouble: {
+                    double d;
+                    if ((size_t)(end - cursor) < sizeof(d)) {
+                        return false;
+                    }
+                    memcpy(&d, cursor, sizeof(d));
+                    cursor += sizeof(d);
+                    stack.push_back(Value::Double(d));
+                    break;
+                }
+                case kSymbol:
+                    if (!this->varint(&n) || n >= symbols.size()) {
+                        return false;
+                    }
+                    stack.push_back(Value(symbols[n]));
+                    break;
+                case kQuote:
+                    stack.push_back(make_quote());
+                    break;
+                case kList:
+                case kDotted: {
+                    bool dotted = cursor[-1] == kDotted;
+                    if (!this->varint(&n) || n + dotted > stack.size()) {
+                        return false;
+                    }
+                    Value list;
+                    if (dotted) {
+                        list = std::move(stack.back());
+                        stack.pop_back();
+                    }
+                    for (; n > 0; --n) {
+                        list = gHashConsing
+                             ? hash_cons(std::move(stack.back()), std::move(list))
+                             : make_cons(std::move(stack.back()), std::move(list));
+                        stack.pop_back();
+                    }
+                    stack.push_back(std::move(list));
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return stack.size() == count;
+    }
+};
+
+// Decodes the encoding at `path`, or returns false.
+bool load(const std::string& path, std::string_view text, std::vector<Value>* expressions) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t size = (size_t)info.st_size;
+    void* data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    bool loaded = Decoder(std::string_view(static_cast<const char*>(data), size))
+                          .decode(text, expressions);
+    if (data) {
+        munmap(data, size);
+    }
+    return loaded;
+}
+
+// Writes the file whole, or not at all, even with other processes writing it
+// at the same time.
+void write_file(const std::string& path, const std::string& contents) {
+    std::string temporary = path + "." + std::to_string(getpid());
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file) {
+        return;
+    }
+    bool written = contents.size() == fwrite(contents.data(), 1, contents.size(), file);
+    if (0 == fclose(file) && written && 0 == rename(temporary.c_str(), path.c_str())) {
+        return;
+    }
+    remove(temporary.c_str());
+}
+
+}  // namespace
+
+std::vector<Value> dissemblance::ParseAll(std::string_view text, const char* cache) {
+    std::vector<Value> expressions;
+    std::string path;
+    if (cache) {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.fasl", (unsigned long long)hash(text));
+        path = std::string(cache) + name;
+        if (load(path, text, &expressions)) {
+            return expressions;
+        }
+        expressions.clear();
+    }
+    const char* cursor = text.data();
+    const char* end = cursor + text.size();
+    while (cursor != end) {
+        Value expr = Parse(&cursor, end);
+        if (!expr) {
+            break;
+        }
+        expressions.push_back(std::move(expr));
+    }
+    if (cache) {
+        Encoder encoder;
+        for (const Value& expr : expressions) {
+            encoder.expression(expr);
+        }
+        mkdir(cache, 0777);
+        write_file(path, encoder.finish(text));
+    }
+    return expressions;
+}
@@ -0,0 +1,274 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// Hash-consing: one shared cons for each structure, and one NumberValue for
+// each large integer, so that a constant repeated throughout a program's data
+// is kept once, and comparing two shared lists takes constant time.
+//
+// The tables of shared objects, by structural hash, hold no references: each
+// removes itself as it is destroyed.  One whose last reference another thread
+// has dropped, but which is not yet destroyed, is passed over, and a new one
+// made in its place.
+
+#include "dissemblance.h"
+#include "expression.h"
+
+#include <cstring>
+#include <mutex>
+#include <typeinfo>
+#include <vector>
+
+using namespace dissemblance;
+
+bool dissemblance::gHashConsing = false;
+
+namespace {
+
+const uint64_t kNilHash = 0x6E696C;
+const uint64_t kMultiplier = 0x9E3779B97F4A7C15;
+
+// Spreads every bit of `h` over the result.
+uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCD;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53;
+    return h ^ (h >> 33);
+}
+
+uint64_t combine(uint64_t left, uint64_t right) {
+    return mix(left * kMultiplier + right);
+}
+
+std::mutex gTableLock;
+
+// The shared T, in chains through them by hash.  Each leaves as it is
+// destroyed.  Call with gTableLock held.
+template <typename T>
+class Table {
+    std::vector<T*> buckets = std::vector<T*>(1024);
+    size_t size = 0;
+
+    T** bucket(uint64_t hash) {
+        return &buckets[hash & (buckets.size() - 1)];
+    }
+
+public:
+    // Returns the entry `matches` accepts, retained, or null.
+    template <typename Matches>
+    Value find(uint64_t hash, Matches matches) {
+        for (T* t = *this->bucket(hash); t; t = t->next) {
+            if (t->hash == hash && matches(t) && Expression::TryRetain(t)) {
+                Value shared(t);
+                Expression::Release(t);  // the one TryRetain() added.
+                return shared;
+            }
+        }
+        return nullptr;
+    }
+
+    void insert(T* t) {
+        if (++size > buckets.size()) {
+            std::vector<T*> old(buckets.size() * 2);
+            old.swap(buckets);
+            for (T* chain : old) {
+                while (T* u = chain) {
+                    chain = u->next;
+                    T** head = this->bucket(u->hash);
+                    u->next = *head;
+                    *head = u;
+                }
+            }
+        }
+        T** head = this->bucket(t->hash);
+        t->next = *head;
+        *head = t;
+    }
+
+    void erase(T* t) {
+        T** link = this->bucket(t->hash);
+        while (*link != t) {
+            link = &(*link)->next;
+        }
+        *link = t->next;
+        --size;
+    }
+};
+
+std::unique_lock<std::mutex> lock_table() {
+    std::unique_lock<std::mutex> lock(gTableLock, std::defer_lock);
+    if (gThreaded) {
+        lock.lock();
+    }
+    return lock;
+}
+
+struct SharedCons final : public Cons {
+    const uint64_t hash;
+    SharedCons* next = nullptr;
+    SharedCons(Value l, Value r, uint64_t h) : Cons(std::move(l), std::move(r)), hash(h) {}
+    ~SharedCons() override;
+};
+
+struct SharedNumber final : public NumberValue {
+    const uint64_t hash;
+    SharedNumber* next = nullptr;
+    SharedNumber(Number n, uint64_t h) : NumberValue(n), hash(h) {}
+    ~SharedNumber() override;
+};
+
+Table<SharedCons>& conses() {
+    static auto table = new Table<SharedCons>;
+    return *table;
+}
+
+Table<SharedNumber>& numbers() {
+    static auto table = new Table<SharedNumber>;
+    return *table;
+}
+
+SharedCons::~SharedCons() {
+    auto lock = lock_table();
+    conses().erase(this);
+}
+
+SharedNumber::~SharedNumber() {
+    auto lock = lock_table();
+    numbers().erase(this);
+}
+
+// As dynamic_cast<const SharedCons*>(e), but faster, since nothing derives
+// from it.
+bool is_shared_cons(const Expression* e) {
+    return typeid(*e) == typeid(SharedCons);
+}
+
+uint64_t integer_hash(int64_t i) {
+    return mix((uint64_t)i);
+}
+
+// The hash of anything but a cons that is not shared.
+uint64_t atom_hash(const Value& value) {
+    if (!value) {
+        return kNilHash;
+    }
+    if (value.isInteger()) {
+        return integer_hash(value.asInteger());
+    }
+    if (value.isDouble()) {
+        double d = value.asDouble();
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        return mix(bits ^ kMultiplier);
+    }
+    const Expression* e = value.get();
+    if (is_shared_cons(e)) {
+        return static_cast<const SharedCons*>(e)->hash;
+    }
+    if (const NumberValue* number = e->asNumberValue()) {
+        return integer_hash(number->value.asInt());
+    }
+    return mix(reinterpret_cast<uintptr_t>(e));  // by identity.
+}
+
+bool is_plain_cons(const Value& value) {
+    const Expression* e = value.get();
+    return e && e->asCons() && !is_shared_cons(e);
+}
+
+}  // namespace
+
+Value dissemblance::hash_cons(Value left, Value right) {
+    uint64_t hash = combine(structural_hash(left), structural_hash(right));
+    Value shared;
+    {
+        auto lock = lock_table();
+        shared = conses().find(hash, [&](const SharedCons* cons) {
+            return cons->left == left && cons->right == right;
+        });
+        if (!shared) {
+            auto cons = new SharedCons(std::move(left), std::move(right), hash);
+            conses().insert(cons);
+            shared = Value(cons);
+        }
+    }
+    return shared;
+}
+
+Value dissemblance::hash_number(Number n) {
+    if (!n.isInt() || Value::FitsInteger(n.asInt())) {
+        return make_number(n);
+    }
+    uint64_t hash = integer_hash(n.asInt());
+    auto lock = lock_table();
+    Value shared = numbers().find(hash, [&](const SharedNumber* number) {
+        return number->value.asInt() == n.asInt();
+    });
+    if (!shared) {
+        auto number = new SharedNumber(n, hash);
+        numbers().insert(number);
+        shared = Value(number);
+    }
+    return shared;
+}
+
+uint64_t dissemblance::structural_hash(const Value& value) {
+    if (!is_plain_cons(value)) {
+        return atom_hash(value);
+    }
+    // The hashes of each cons's parts, left first, and then of the cons,
+    // without recursion.
+    struct Pending {
+        const Value* value;
+        bool expanded;
+    };
+    std::vector<Pending> stack{{&value, false}};
+    std::vector<uint64_t> hashes;
+    while (!stack.empty()) {
+        Pending& top = stack.back();
+        if (top.expanded) {
+            uint64_t right = hashes.back();
+            hashes.pop_back();
+            hashes.back() = combine(hashes.back(), right);
+            stack.pop_back();
+        } else if (!is_plain_cons(*top.value)) {
+            hashes.push_back(atom_hash(*top.value));
+            stack.pop_back();
+        } else {
+            top.expanded = true;
+            const Cons* cons = dcastCons(*top.value);
+            stack.push_back(Pending{&cons->right, false});
+            stack.push_back(Pending{&cons->left, false});
+        }
+    }
+    return hashes.back();
+}
+
+bool dissemblance::equal(const Value& u, const Value& v) {
+    std::vector<std::pair<const Value*, const Value*>> pending{{&u, &v}};
+    while (!pending.empty()) {
+        const Value& x = *pending.back().first;
+        const Value& y = *pending.back().second;
+        pending.pop_back();
+        if (x == y) {
+            continue;
+        }
+        const Cons* cx = dcastCons(x);
+        const Cons* cy = dcastCons(y);
+        if (!cx || !cy) {
+            const NumberValue* nx = dcastNumberValue(x);
+            const NumberValue* ny = dcastNumberValue(y);
+            if (nx && ny && nx->value.isInt() && ny->value.isInt() &&
+                nx->value.asInt() == ny->value.asInt()) {
+                continue;
+            }
+            return false;
+        }
+        if (is_shared_cons(cx) && is_shared_cons(cy)) {
+            return false;  // different structures, or they would be the same cons.
+        }
+        pending.emplace_back(&cx->right, &cy->right);
+        pending.emplace_back(&cx->left, &cy->left);
+    }
+    return true;
+}
@@ -0,0 +1,303 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// Hash tables, and the procedures on them.
+//
+// A table is one array of slots, each holding its key's hash beside the key
+// and value, probed linearly from where the hash points, so that a lookup
+// usually reads one cache line.  The array is a power of two long and at most
+// three quarters full; removing a key shifts back the keys after it that
+// belong before the hole, so there are no tombstones.  Keys are equal? to each
+// other: numbers by value and symbols by address, since they are interned;
+// anything else by its structural_hash() and equal().
+//
+// A table may be shared between threads, so once they may be running, each
+// operation holds the table's lock.
+
+#include "dissemblance.h"
+#include "expression.h"
+
+#include <cassert>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+using namespace dissemblance;
+
+namespace {
+
+const size_t kMinimumCapacity = 8;
+const uint64_t kFull = (uint64_t)1 << 63;  // set in the hash of every full slot.
+
+struct HashTable : public Expression {
+    struct Slot {
+        uint64_t hash = 0;  // 0 if the slot is empty.
+        Value key;
+        Value value;
+    };
+    mutable std::vector<Slot> slots = std::vector<Slot>(kMinimumCapacity);
+    mutable size_t count = 0;
+    mutable std::mutex lock;
+
+    std::unique_lock<std::mutex> hold() const {
+        std::unique_lock<std::mutex> l(lock, std::defer_lock);
+        if (gThreaded) {
+            l.lock();
+        }
+        return l;
+    }
+
+    static uint64_t Hash(const Value& key) {
+        return structural_hash(key) | kFull;
+    }
+
+    // The slot holding `key`, or else the empty slot where it would go.
+    Slot* find(const Value& key, uint64_t hash) const {
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            Slot* slot = &slots[i];
+            if (!slot->hash ||
+                (slot->hash == hash && (slot->key == key || equal(slot->key, key)))) {
+                return slot;
+            }
+        }
+    }
+
+    void set(Value key, Value value) const {
+        uint64_t hash = Hash(key);
+        Slot* slot = this->find(key, hash);
+        if (!slot->hash) {
+            if (4 * (count + 1) > 3 * slots.size()) {
+                this->grow();
+                slot = this->find(key, hash);
+            }
+            slot->hash = hash;
+            slot->key = std::move(key);
+            ++count;
+        }
+        slot->value = std::move(value);
+    }
+
+    void grow() const {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (Slot& slot : old) {
+            if (slot.hash) {
+                size_t i = slot.hash & mask;
+                while (slots[i].hash) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = std::move(slot);
+            }
+        }
+    }
+
+    void remove(const Value& key) const {
+        Slot* slot = this->find(key, Hash(key));
+        if (!slot->hash) {
+            return;
+        }
+        slot->key = nullptr;
+        slot->value = nullptr;
+        // Shift back each following key whose probe starts at or before the
+        // hole, until an empty slot ends the run.
+        size_t mask = slots.size() - 1;
+        size_t hole = slot - slots.data();
+        for (size_t i = (hole + 1) & mask; slots[i].hash; i = (i + 1) & mask) {
+            size_t home = slots[i].hash & mask;
+            if (((i - home) & mask) >= ((i - hole) & mask)) {
+                slots[hole] = std::move(slots[i]);
+                hole = i;
+            }
+        }
+        slots[hole].hash = 0;
+        --count;
+    }
+
+    void serialize(std::ostream* o) const override {
+        *o << "#<hash-table " << count << ">";
+    }
+    void trace(Tracer* t) const override {
+        for (const Slot& slot : slots) {
+            t->trace(slot.key);
+            t->trace(slot.value);
+        }
+    }
+    void clear() override {
+        slots = std::vector<Slot>(kMinimumCapacity);
+        count = 0;
+    }
+};
+
+const HashTable* to_table(const Value& value) {
+    auto table = dynamic_cast<const HashTable*>(value.get());
+    assert(table);  // is a hash table
+    return table;
+}
+
+class HashTableProcedure : public Procedure {
+    const char* name;
+public:
+    HashTableProcedure(const char* n) : name(n) {}
+    void serialize(std::ostream* o) const override { *o << name; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+};
+
+// (make-hash-table)
+class MakeHashTable : public HashTableProcedure {
+public:
+    MakeHashTable() : HashTableProcedure("make-hash-table") {}
+    Value apply(
+            const Value*, int count) const override {
+        assert(0 == count);
+        return Value(new HashTable);
+    }
+};
+
+// (hash-ref table key [default]): the value of `key`, or else `default`, or ().
+class HashRef : public HashTableProcedure {
+public:
+    HashRef() : HashTableProcedure("hash-ref") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(2 == count || 3 == count);
+        const HashTable* table = to_table(args[0]);
+        uint64_t hash = HashTable::Hash(args[1]);
+        auto lock = table->hold();
+        const HashTable::Slot* slot = table->find(args[1], hash);
+        if (slot->hash) {
+            return slot->value;
+        }
+        return count == 3 ? args[2] : nullptr;
+    }
+};
+
+// (hash-set! table key value)
+class HashSet : public HashTableProcedure {
+public:
+    HashSet() : HashTableProcedure("hash-set!") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(3 == count);
+        const HashTable* table = to_table(args[0]);
+        auto lock = table->hold();
+        table->set(args[1], args[2]);
+        return nullptr;
+    }
+};
+
+// (hash-remove! table key)
+class HashRemove : public HashTableProcedure {
+public:
+    HashRemove() : HashTableProcedure("hash-remove!") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(2 == count);
+        const HashTable* table = to_table(args[0]);
+        auto lock = table->hold();
+        table->remove(args[1]);
+        return nullptr;
+    }
+};
+
+// (hash-count table)
+class HashCount : public HashTableProcedure {
+public:
+    HashCount() : HashTableProcedure("hash-count") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(1 == count);
+        const HashTable* table = to_table(args[0]);
+        auto lock = table->hold();
+        return Value::Integer((int64_t)table->count);
+    }
+};
+
+// The table's entries, in the order of its slots, as they are now.
+std::vector<std::pair<Value, Value>> entries(const HashTable* table) {
+    std::vector<std::pair<Value, Value>> result;
+    auto lock = table->hold();
+    result.reserve(table->count);
+    for (const HashTable::Slot& slot : table->slots) {
+        if (slot.hash) {
+            result.emplace_back(slot.key, slot.value);
+        }
+    }
+    return result;
+}
+
+// (hash-keys table) and (hash->list table), a list of its keys or of its
+// (key . value) pairs.
+template <bool Pairs>
+class HashList : public HashTableProcedure {
+public:
+    HashList(const char* n) : HashTableProcedure(n) {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(1 == count);
+        Value list;
+        for (auto& entry : entries(to_table(args[0]))) {
+            list = make_cons(Pairs ? make_cons(std::move(entry.first), std::move(entry.second))
+                                   : std::move(entry.first),
+                             std::move(list));
+        }
+        return list;
+    }
+};
+
+// (hash-for-each table procedure) calls (procedure key value) for each entry
+// the table had when it began.
+class HashForEach : public HashTableProcedure {
+public:
+    HashForEach() : HashTableProcedure("hash-for-each") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(2 == count);
+        const Procedure* proc = dcastProcedure(args[1]);
+        assert(proc);
+        for (auto& entry : entries(to_table(args[0]))) {
+            Value pair[2] = {std::move(entry.first), std::move(entry.second)};
+            proc->apply(pair, 2);
+        }
+        return nullptr;
+    }
+};
+
+}  // namespace
+
+bool dissemblance::hash_table_entries(
+        const Expression* e, std::vector<std::pair<Value, Value>>* result) {
+    auto table = dynamic_cast<const HashTable*>(e);
+    if (!table) {
+        return false;
+    }
+    *result = entries(table);
+    return true;
+}
+
+Value dissemblance::make_hash_table() {
+    return Value(new HashTable);
+}
+
+void dissemblance::hash_table_set(const Value& table, Value key, Value value) {
+    const HashTable* t = to_table(table);
+    auto lock = t->hold();
+    t->set(std::move(key), std::move(value));
+}
+
+void dissemblance::add_hash_table_procedures(Env* env) {
+    auto& map = env->map;
+    map[intern("make-hash-table")] = Value(new MakeHashTable);
+    map[intern("hash-ref")] = Value(new HashRef);
+    map[intern("hash-set!")] = Value(new HashSet);
+    map[intern("hash-remove!")] = Value(new HashRemove);
+    map[intern("hash-count")] = Value(new HashCount);
+    map[intern("hash-keys")] = Value(new HashList<false>("hash-keys"));
+    map[intern("hash->list")] = Value(new HashList<true>("hash->list"));
+    map[intern("hash-for-each")] = Value(new HashForEach);
+}
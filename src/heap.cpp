@@ -0,0 +1,513 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// Where Expressions live: the slabs they are allocated from, the list of
+// every Expression, and the collector that frees the cycles reference
+// counting cannot.
+//
+// Each slab holds objects of one size class.  Allocation takes the slab's most
+// recently freed object, or else bumps a pointer through the slab's unused
+// space, so objects allocated together, such as the cells of a parsed list or
+// a call's frame and arguments, sit together.  A slab knows how many of its
+// objects are live, so once the temporaries of a top-level form are freed the
+// slabs they filled go back to the system whole.
+//
+// Each thread allocates from slabs of its own and lists the objects it
+// allocated, so that threads allocate without locking.  An object is always
+// deleted by the thread that allocated it: when another thread releases the
+// last reference, the object waits on its owner's list of orphans until the
+// owner next deletes orphans.
+//
+// The collector needs no list of roots.  From each object's reference count it
+// subtracts the references that other objects on the heap hold; whatever has
+// references left over is held from outside the heap: by an Environment, a
+// Value on the C++ stack or the VM's stack, or a compiled lambda.  Everything
+// those roots reach is marked, and the rest is garbage.  It runs only while
+// no thread is running a task.  Only the main thread's allocations count
+// towards the next collection; other threads ask for one from outside tasks.
+
+#include "dissemblance.h"
+#include "expression.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <vector>
+
+using namespace dissemblance;
+
+namespace {
+// Collect no more often than this, nor before the heap has doubled.
+const int64_t kMinimumAllocations = 1 << 16;
+const int32_t kReachable = -1;
+
+const size_t kSlabSize = 64 * 1024;  // also the slabs' alignment.
+const size_t kGranule = 16;
+const size_t kSizeClasses = 16;  // up to 256 bytes.
+
+struct FreeObject {
+    FreeObject* next;
+};
+
+struct ThreadHeap;
+
+// The header at the start of every slab.
+struct Slab {
+    Slab* prev;  // the size class's list of slabs with room.
+    Slab* next;
+    FreeObject* freeList;
+    char* unused;  // where objects never yet allocated begin.
+    char* end;
+    size_t objectSize;
+    uint64_t live;
+    ThreadHeap* owner;
+
+    bool full() const { return !freeList && unused + objectSize > end; }
+};
+
+const size_t kSlabHeader = (sizeof(Slab) + kGranule - 1) / kGranule * kGranule;
+
+struct SizeClass {
+    Slab* available;  // slabs with room.
+    uint64_t slabs;
+    uint64_t liveObjects;
+    uint64_t allocations;
+};
+
+// What each thread allocates from, and its list of the objects it allocated.
+struct ThreadHeap {
+    SizeClass sizeClasses[kSizeClasses] = {};
+    Expression* first = nullptr;
+    uint64_t liveObjects = 0;
+    uint64_t largeAllocations = 0;
+    uint64_t made[(int)Expression::Kind::Count] = {};  // see GetHeapStats().
+    uint64_t bytes = 0;
+    uint64_t peakBytes = 0;
+    uint32_t deepestFrame = 0;
+    std::mutex lock;  // guards orphans.
+    std::vector<const Expression*> orphans;  // released by other threads.
+};
+
+std::atomic<uint64_t> gSlabs, gPeakSlabs, gSlabsReleased;
+
+std::mutex gHeapsLock;
+std::vector<ThreadHeap*> gHeaps;  // never freed, since objects outlive threads.
+ThreadHeap* gMainHeap;  // the first thread to allocate's.
+thread_local ThreadHeap* tHeap;
+
+ThreadHeap* this_heap() {
+    if (!tHeap) {
+        tHeap = new ThreadHeap;
+        std::lock_guard<std::mutex> lock(gHeapsLock);
+        gHeaps.push_back(tHeap);
+        if (!gMainHeap) {
+            gMainHeap = tHeap;
+        }
+    }
+    return tHeap;
+}
+
+Slab* slab_of(const void* object) {
+    return reinterpret_cast<Slab*>(
+            reinterpret_cast<uintptr_t>(object) & ~(uintptr_t)(kSlabSize - 1));
+}
+
+void* allocate_slab(size_t size) {
+    void* memory = nullptr;
+    if (0 != posix_memalign(&memory, kSlabSize, size)) {
+        throw std::bad_alloc();
+    }
+    uint64_t slabs = ++gSlabs;
+    uint64_t peak = gPeakSlabs.load(std::memory_order_relaxed);
+    while (slabs > peak && !gPeakSlabs.compare_exchange_weak(peak, slabs)) {}
+    return memory;
+}
+
+void free_slab(Slab* slab) {
+    free(slab);
+    --gSlabs;
+    ++gSlabsReleased;
+}
+
+void push(SizeClass* sc, Slab* slab) {
+    slab->prev = nullptr;
+    slab->next = sc->available;
+    if (sc->available) {
+        sc->available->prev = slab;
+    }
+    sc->available = slab;
+}
+
+void remove(SizeClass* sc, Slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        sc->available = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+Slab* new_slab(ThreadHeap* heap, SizeClass* sc, size_t objectSize) {
+    Slab* slab = static_cast<Slab*>(allocate_slab(kSlabSize));
+    slab->freeList = nullptr;
+    slab->unused = reinterpret_cast<char*>(slab) + kSlabHeader;
+    slab->end = reinterpret_cast<char*>(slab) + kSlabSize;
+    slab->objectSize = objectSize;
+    slab->live = 0;
+    slab->owner = heap;
+    push(sc, slab);
+    ++sc->slabs;
+    return slab;
+}
+}  // namespace
+
+// An object too large for any size class gets a slab of its own, only as
+// large as it needs, so that every object's owner is in the slab header.
+void* dissemblance::Expression::operator new(size_t size) {
+    ThreadHeap* heap = this_heap();
+    if (size > kSizeClasses * kGranule) {
+        assert(kSlabHeader + size <= kSlabSize);
+        Slab* slab = static_cast<Slab*>(allocate_slab(kSlabHeader + size));
+        slab->owner = heap;
+        ++heap->largeAllocations;
+        heap->bytes += size;
+        heap->peakBytes = std::max(heap->peakBytes, heap->bytes);
+        return reinterpret_cast<char*>(slab) + kSlabHeader;
+    }
+    size_t index = (size - 1) / kGranule;
+    SizeClass* sc = &heap->sizeClasses[index];
+    Slab* slab = sc->available;
+    if (!slab) {
+        slab = new_slab(heap, sc, (index + 1) * kGranule);
+    }
+    void* object;
+    if (slab->freeList) {
+        object = slab->freeList;
+        slab->freeList = slab->freeList->next;
+    } else {
+        object = slab->unused;
+        slab->unused += slab->objectSize;
+    }
+    ++slab->live;
+    ++sc->liveObjects;
+    ++sc->allocations;
+    heap->bytes += slab->objectSize;
+    heap->peakBytes = std::max(heap->peakBytes, heap->bytes);
+    if (slab->full()) {
+        remove(sc, slab);
+    }
+    return object;
+}
+
+// Called by the object's owner, or by the collector while the owner is idle.
+void dissemblance::Expression::operator delete(void* object, size_t size) {
+    Slab* slab = slab_of(object);
+    if (size > kSizeClasses * kGranule) {
+        slab->owner->bytes -= size;
+        free_slab(slab);
+        return;
+    }
+    slab->owner->bytes -= slab->objectSize;
+    SizeClass* sc = &slab->owner->sizeClasses[(size - 1) / kGranule];
+    if (slab->full()) {
+        push(sc, slab);
+    }
+    FreeObject* freed = static_cast<FreeObject*>(object);
+    freed->next = slab->freeList;
+    slab->freeList = freed;
+    --slab->live;
+    --sc->liveObjects;
+    // Keep one slab with room, so that a loop freeing and allocating an
+    // object at the edge of a slab does not keep returning it and getting it
+    // back.
+    if (0 == slab->live && (slab->next || slab->prev)) {
+        remove(sc, slab);
+        --sc->slabs;
+        free_slab(slab);
+    }
+}
+
+AllocatorStats dissemblance::GetAllocatorStats() {
+    AllocatorStats stats;
+    std::lock_guard<std::mutex> lock(gHeapsLock);
+    for (size_t i = 0; i < kSizeClasses; ++i) {
+        AllocatorStats::SizeClass s;
+        s.objectSize = (i + 1) * kGranule;
+        for (ThreadHeap* heap : gHeaps) {
+            const SizeClass& sc = heap->sizeClasses[i];
+            s.slabs += sc.slabs;
+            s.liveObjects += sc.liveObjects;
+            s.allocations += sc.allocations;
+        }
+        if (s.allocations) {
+            stats.sizeClasses.push_back(s);
+            stats.bytesInUse += s.liveObjects * s.objectSize;
+        }
+    }
+    for (ThreadHeap* heap : gHeaps) {
+        stats.largeAllocations += heap->largeAllocations;
+    }
+    stats.slabs = gSlabs;
+    stats.peakSlabs = gPeakSlabs;
+    stats.slabsReleased = gSlabsReleased;
+    return stats;
+}
+
+HeapStats dissemblance::GetHeapStats() {
+    HeapStats stats;
+    std::lock_guard<std::mutex> lock(gHeapsLock);
+    for (ThreadHeap* heap : gHeaps) {
+        using Kind = Expression::Kind;
+        stats.conses += heap->made[(int)Kind::Cons];
+        stats.numbers += heap->made[(int)Kind::Number];
+        stats.symbols += heap->made[(int)Kind::Symbol];
+        stats.lambdas += heap->made[(int)Kind::Lambda];
+        stats.frames += heap->made[(int)Kind::Frame];
+        for (uint64_t made : heap->made) {
+            stats.objects += made;
+        }
+        stats.bytesLive += heap->bytes;
+        stats.peakBytesLive += heap->peakBytes;
+        stats.deepestFrame = std::max<uint64_t>(stats.deepestFrame, heap->deepestFrame);
+    }
+    return stats;
+}
+
+std::atomic<int64_t> dissemblance::gAllocationsUntilCollection{kMinimumAllocations};
+
+namespace {
+// Held shared while a task runs, and exclusively while the collector does.
+std::shared_mutex gWorld;
+thread_local int tRunningTasks = 0;  // more than one while a task waits.
+}  // namespace
+
+namespace dissemblance {
+
+class Heap {
+    static CollectorStats gStats;
+
+    // Counts the references held from inside the heap.
+    struct Subtract : public Tracer {
+        void visit(const Expression* e) override { --e->collectorCount; }
+    };
+
+    struct Mark : public Tracer {
+        std::vector<const Expression*> stack;
+        void visit(const Expression* e) override {
+            if (e->collectorCount != kReachable) {
+                e->collectorCount = kReachable;
+                stack.push_back(e);
+            }
+        }
+    };
+
+    template <typename F>
+    static void ForEach(F f) {
+        for (ThreadHeap* heap : gHeaps) {
+            for (Expression* e = heap->first; e; e = e->next) {
+                f(e);
+            }
+        }
+    }
+
+public:
+    // Called by the thread that allocated e, so its heap is this thread's.
+    static void Link(Expression* e) {
+        ThreadHeap* heap = tHeap;
+        e->prev = nullptr;
+        e->next = heap->first;
+        if (heap->first) {
+            heap->first->prev = e;
+        }
+        heap->first = e;
+        ++heap->liveObjects;
+        if (heap == gMainHeap) {
+            gAllocationsUntilCollection.store(
+                    gAllocationsUntilCollection.load(std::memory_order_relaxed) - 1,
+                    std::memory_order_relaxed);
+        }
+    }
+
+    static void Unlink(Expression* e) {
+        ThreadHeap* heap = slab_of(e)->owner;
+        if (e->prev) {
+            e->prev->next = e->next;
+        } else {
+            heap->first = e->next;
+        }
+        if (e->next) {
+            e->next->prev = e->prev;
+        }
+        --heap->liveObjects;
+    }
+
+    // Deleting the head of a long list releases its tail, which would delete
+    // the next cell from inside the first one's destructor, and so on down
+    // the list.  Instead, whatever is freed while an object is being deleted
+    // waits its turn.
+    static void Delete(const Expression* e) {
+        static thread_local bool destroying = false;
+        static thread_local std::vector<const Expression*> pending;
+        if (destroying) {
+            pending.push_back(e);
+            return;
+        }
+        destroying = true;
+        delete e;
+        while (!pending.empty()) {
+            const Expression* next = pending.back();
+            pending.pop_back();
+            delete next;
+        }
+        destroying = false;
+    }
+
+    // Deletes the objects other threads released last, on behalf of the
+    // heap's owner, and returns whether there were any.
+    static bool DeleteOrphans(ThreadHeap* heap) {
+        std::vector<const Expression*> orphans;
+        {
+            std::lock_guard<std::mutex> lock(heap->lock);
+            orphans.swap(heap->orphans);
+        }
+        for (const Expression* e : orphans) {
+            Delete(e);
+        }
+        return !orphans.empty();
+    }
+
+    static uint64_t LiveObjects() {
+        uint64_t live = 0;
+        for (ThreadHeap* heap : gHeaps) {
+            live += heap->liveObjects;
+        }
+        return live;
+    }
+
+    static void Collect() {
+        if (tRunningTasks) {
+            return;
+        }
+        if (!gWorld.try_lock()) {
+            // Tasks are running; try again later.
+            gAllocationsUntilCollection = kMinimumAllocations;
+            return;
+        }
+        std::lock_guard<std::mutex> heapsLock(gHeapsLock);
+        auto start = std::chrono::steady_clock::now();
+        // Orphans have no references left, and must not be found as garbage.
+        bool deleted;
+        do {
+            deleted = false;
+            for (ThreadHeap* heap : gHeaps) {
+                deleted = DeleteOrphans(heap) || deleted;
+            }
+        } while (deleted);
+
+        ForEach([](Expression* e) { e->collectorCount = e->refCount; });
+        Subtract subtract;
+        ForEach([&](Expression* e) { e->trace(&subtract); });
+        Mark mark;
+        ForEach([&](Expression* e) {
+            assert(e->collectorCount >= 0);  // trace() passed only counted references.
+            if (e->collectorCount > 0) {
+                mark.visit(e);
+            }
+        });
+        while (!mark.stack.empty()) {
+            const Expression* e = mark.stack.back();
+            mark.stack.pop_back();
+            e->trace(&mark);
+        }
+        std::vector<Expression*> garbage;
+        ForEach([&](Expression* e) {
+            if (e->collectorCount != kReachable) {
+                garbage.push_back(e);
+            }
+        });
+        // Hold on to every piece of the cycles while breaking them, so that
+        // nothing is freed while another piece still points to it.  Pieces
+        // other threads allocated are deleted here too, while they are idle.
+        for (Expression* e : garbage) {
+            ++e->refCount;
+        }
+        for (Expression* e : garbage) {
+            e->clear();
+        }
+        for (Expression* e : garbage) {
+            if (0 == --e->refCount) {
+                Delete(e);
+            }
+        }
+
+        auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start);
+        ++gStats.collections;
+        gStats.objectsFreed += garbage.size();
+        gStats.totalPause += pause;
+        gStats.longestPause = std::max(gStats.longestPause, pause);
+        gAllocationsUntilCollection =
+            std::max(kMinimumAllocations, (int64_t)LiveObjects());
+        gWorld.unlock();
+    }
+
+    static CollectorStats Stats() {
+        std::lock_guard<std::mutex> lock(gHeapsLock);
+        CollectorStats stats = gStats;
+        stats.liveObjects = LiveObjects();
+        return stats;
+    }
+};
+
+CollectorStats Heap::gStats;
+
+}  // namespace dissemblance
+
+dissemblance::Expression::Expression() : Expression(Kind::Other) {}
+
+dissemblance::Expression::Expression(Kind kind) {
+    Heap::Link(this);
+    ++tHeap->made[(int)kind];
+}
+
+dissemblance::Environment::Impl::Impl(Ref<Impl> o)
+        : Expression(Kind::Frame), outer(std::move(o)), depth(outer ? outer->depth + 1 : 0) {
+    tHeap->deepestFrame = std::max(tHeap->deepestFrame, depth);
+}
+
+dissemblance::Expression::~Expression() { Heap::Unlink(this); }
+
+void dissemblance::Expression::Destroy(const Expression* e) {
+    if (gThreaded) {
+        ThreadHeap* owner = slab_of(e)->owner;
+        if (owner != tHeap) {
+            std::lock_guard<std::mutex> lock(owner->lock);
+            owner->orphans.push_back(e);
+            return;
+        }
+    }
+    Heap::Delete(e);
+}
+
+dissemblance::RunningTask::RunningTask() {
+    if (0 == tRunningTasks++) {
+        gWorld.lock_shared();
+    }
+}
+
+dissemblance::RunningTask::~RunningTask() {
+    Heap::DeleteOrphans(this_heap());
+    if (0 == --tRunningTasks) {
+        gWorld.unlock_shared();
+    }
+}
+
+void dissemblance::CollectGarbage() { Heap::Collect(); }
+
+CollectorStats dissemblance::GetCollectorStats() { return Heap::Stats(); }
@@ -0,0 +1,663 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// Images: an environment and everything it reaches, saved to a file so that a
+// later run can start from it instead of evaluating the same definitions.
+//
+// An image is a sequence of 64-bit words in the machine's own byte order:
+//
+//     header:   kMagic kVersion symbols codes objects
+//     symbols:  length, then the name, padded to a whole word
+//     codes:    parameters arity name variables [symbol...] body
+//     objects:  kind, then fields by kind; the first is the environment
+//
+// Every reference is an index into one of those tables rather than an
+// address, so an image loads anywhere.  A value is two words, a tag and a
+// payload.  Objects are numbered in the order they are first reached, and
+// written in that order, so a load can make every object first and fill in
+// their references after, however they refer to each other.  A load maps
+// the file and reads it in place, in one pass over each table; nothing is
+// parsed, resolved or evaluated.
+//
+// Builtins are saved by the name they print as, and found again in a new core
+// environment; the objects that stand in for special forms in resolved bodies
+// are kinds of their own.
+// Compiled bytecode is not saved, and is compiled again when first run.
+
+#include "dissemblance.h"
+#include "expression.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace dissemblance;
+
+namespace {
+
+const uint64_t kMagic = 0x474D4953534D4944;  // "DISMSIMG" in little-endian.
+const uint64_t kVersion = 2;
+const uint64_t kNone = ~(uint64_t)0;  // no code, or no name.
+
+enum Tag : uint64_t { kNil, kInteger, kDouble, kSymbol, kObject };
+
+enum Kind : uint64_t {
+    kCons,         // left right
+    kNumber,       // isInt bits
+    kLocalRef,     // symbol depth slot
+    kGlobalRef,    // symbol
+    kLambda,       // code environment
+    kMakeClosure,  // code
+    kSetLocal,     // form
+    kEnvironment,  // outer code frozen slots [value...] bindings [symbol value...]
+    kBuiltin,      // symbol of its printed name
+    kVector,       // isDouble size [element...]
+    kHashTable,    // size [key value...]
+};
+
+class ImageWriter {
+    std::vector<uint64_t> objectWords;
+    std::vector<uint64_t> codeWords;
+    std::vector<uint64_t>* out = &objectWords;
+    std::unordered_map<const Symbol*, uint64_t> symbolIndex;
+    std::vector<const Symbol*> symbols;
+    std::unordered_map<const LambdaCode*, uint64_t> codeIndex;
+    std::vector<const LambdaCode*> codes;
+    std::unordered_map<const Expression*, uint64_t> objectIndex;
+    std::vector<const Expression*> objects;
+    std::vector<std::pair<Value, Value>> entries;  // scratch, of a hash table.
+    bool unsaved = false;  // whether anything could not be written.
+
+    uint64_t symbol(const Symbol* s) {
+        auto i = symbolIndex.emplace(s, symbols.size());
+        if (i.second) {
+            symbols.push_back(s);
+        }
+        return i.first->second;
+    }
+    uint64_t code(const std::shared_ptr<const LambdaCode>& c) {
+        if (!c) {
+            return kNone;
+        }
+        auto i = codeIndex.emplace(c.get(), codes.size());
+        if (i.second) {
+            codes.push_back(c.get());
+        }
+        return i.first->second;
+    }
+    uint64_t object(const Expression* e) {
+        auto i = objectIndex.emplace(e, objects.size());
+        if (i.second) {
+            objects.push_back(e);
+        }
+        return i.first->second;
+    }
+
+    void emit(uint64_t word) { out->push_back(word); }
+    void emit(const Value& v) {
+        if (!v) {
+            this->emit(kNil);
+            this->emit(0);
+        } else if (v.isInteger()) {
+            this->emit(kInteger);
+            this->emit((uint64_t)v.asInteger());
+        } else if (v.isDouble()) {
+            double d = v.asDouble();
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            this->emit(kDouble);
+            this->emit(bits);
+        } else if (const Symbol* s = dcastSymbol(v)) {
+            this->emit(kSymbol);
+            this->emit(this->symbol(s));
+        } else {
+            this->emit(kObject);
+            this->emit(this->object(v.get()));
+        }
+    }
+
+    // Emits the object's fields, numbering what it refers to.
+    void write(const Expression* e) {
+        if (const Cons* cons = e->asCons()) {
+            this->emit(kCons);
+            this->emit(cons->left);
+            this->emit(cons->right);
+        } else if (const NumberValue* number = e->asNumberValue()) {
+            this->emit(kNumber);
+            this->emit(number->value.isInt());
+            if (number->value.isInt()) {
+                this->emit((uint64_t)number->value.asInt());
+            } else {
+                double d = number->value.asDouble();
+                uint64_t bits;
+                memcpy(&bits, &d, sizeof(bits));
+                this->emit(bits);
+            }
+        } else if (const LocalRef* ref = e->asLocalRef()) {
+            this->emit(kLocalRef);
+            this->emit(this->symbol(ref->symbol));
+            this->emit((uint64_t)ref->depth);
+            this->emit((uint64_t)ref->slot);
+        } else if (const GlobalRef* ref = e->asGlobalRef()) {
+            this->emit(kGlobalRef);
+            this->emit(this->symbol(ref->symbol));
+        } else if (const Env* env = dynamic_cast<const Env*>(e)) {
+            this->emit(kEnvironment);
+            this->emit(Value(env->outer.get()));
+            this->emit(this->code(env->code));
+            this->emit(env->frozen);
+            this->emit(env->slots.size());
+            for (const Value& v : env->slots) {
+                this->emit(v);
+            }
+            this->emit(env->map.size());
+            for (const auto& binding : env->map) {
+                this->emit(this->symbol(binding.first));
+                this->emit(binding.second);
+            }
+        } else if (auto closure = dynamic_cast<const MakeClosure*>(e)) {
+            this->emit(kMakeClosure);
+            this->emit(this->code(closure->code));
+        } else if (auto set = dynamic_cast<const SetLocal*>(e)) {
+            this->emit(kSetLocal);
+            this->emit((uint64_t)set->definition);
+        } else if (const Procedure* proc = e->asProcedure()) {
+            if (const LambdaProc* lambda = proc->asLambdaProc()) {
+                this->emit(kLambda);
+                this->emit(this->code(lambda->code));
+                this->emit(Value(lambda->environment.get()));
+            } else {
+                std::ostringstream name;
+                proc->serialize(&name);
+                this->emit(kBuiltin);
+                this->emit(this->symbol(intern(name.str())));
+            }
+        } else if (hash_table_entries(e, &entries)) {
+            this->emit(kHashTable);
+            this->emit(entries.size());
+            for (const auto& entry : entries) {
+                this->emit(entry.first);
+                this->emit(entry.second);
+            }
+        } else {
+            bool isDouble;
+            const void* data;
+            size_t size;
+            if (!vector_contents(e, &isDouble, &data, &size)) {
+                std::cerr << "can not save ";
+                e->serialize(&std::cerr);
+                std::cerr << " in an image.\n";
+                unsaved = true;
+                return;
+            }
+            this->emit(kVector);
+            this->emit(isDouble);
+            this->emit(size);
+            size_t start = out->size();
+            out->resize(start + size);
+            memcpy(&(*out)[start], data, size * sizeof(uint64_t));
+        }
+    }
+
+    void write(const LambdaCode* c) {
+        this->emit(c->parameters);
+        this->emit((uint64_t)c->arity);
+        const Symbol* name = c->name;
+        this->emit(name ? this->symbol(name) : kNone);
+        this->emit(c->variables.size());
+        for (const Symbol* variable : c->variables) {
+            this->emit(this->symbol(variable));
+        }
+        // Which names were folded is not kept, so a loaded lambda could not
+        // tell when its folds go stale; it runs what was written.
+        this->emit(c->unfolded ? c->unfolded : c->body);
+    }
+
+public:
+    // Returns an empty image if anything could not be written.
+    std::vector<uint64_t> save(const Environment& env) {
+        this->object(env.impl.get());
+        // Writing an object or a code numbers those it refers to, to be
+        // written in turn.
+        size_t objectsWritten = 0, codesWritten = 0;
+        while (objectsWritten < objects.size() || codesWritten < codes.size()) {
+            out = &objectWords;
+            while (objectsWritten < objects.size()) {
+                this->write(objects[objectsWritten++]);
+            }
+            out = &codeWords;
+            while (codesWritten < codes.size()) {
+                this->write(codes[codesWritten++]);
+            }
+        }
+        if (unsaved) {
+            return {};
+        }
+        std::vector<uint64_t> image = {kMagic, kVersion, symbols.size(), codes.size(),
+                                       objects.size()};
+        for (const Symbol* s : symbols) {
+            size_t start = image.size();
+            image.push_back(s->name.size());
+            image.resize(start + 1 + (s->name.size() + 7) / 8);
+            memcpy(&image[start + 1], s->name.data(), s->name.size());
+        }
+        image.insert(image.end(), codeWords.begin(), codeWords.end());
+        image.insert(image.end(), objectWords.begin(), objectWords.end());
+        return image;
+    }
+};
+
+class ImageReader {
+    const uint64_t* cursor;
+    const uint64_t* end;
+    std::vector<const Symbol*> symbols;
+    std::vector<std::shared_ptr<LambdaCode>> codes;
+    std::vector<Value> objects;
+    std::vector<const uint64_t*> fields;  // of each object, to fill in.
+    std::vector<Env*> frames;
+    // Hash tables' entries, added once their keys are filled in to be hashed.
+    std::vector<std::pair<Value, std::pair<Value, Value>>> entries;
+    std::unordered_map<std::string, Value> builtins;  // by printed name.
+    // Set at the first word out of place, such as past the end or naming
+    // what is not there, after which reads give null or zero, and the load
+    // fails at the end of the pass.
+    bool corrupt = false;
+
+    uint64_t next() {
+        if (cursor == end) {
+            corrupt = true;
+            return 0;
+        }
+        return *cursor++;
+    }
+    // A count of things `width` words each, which the rest of the image must
+    // have room for.
+    uint64_t count(uint64_t width = 1) {
+        uint64_t n = this->next();
+        if (n > (uint64_t)(end - cursor) / width) {
+            corrupt = true;
+            return 0;
+        }
+        return n;
+    }
+    void skip(uint64_t words) {
+        if (words > (uint64_t)(end - cursor)) {
+            corrupt = true;
+            words = end - cursor;
+        }
+        cursor += words;
+    }
+    template <typename T>
+    T entry(const std::vector<T>& table, uint64_t index) {
+        if (index >= table.size()) {
+            corrupt = true;
+            return T();
+        }
+        return table[index];
+    }
+    const Symbol* symbol() { return this->entry(symbols, this->next()); }
+    std::shared_ptr<LambdaCode> code() {
+        uint64_t index = this->next();
+        return index == kNone ? nullptr : this->entry(codes, index);
+    }
+    Value value() {
+        uint64_t tag = this->next();
+        uint64_t payload = this->next();
+        switch (tag) {
+            case kNil:
+                return nullptr;
+            case kInteger:
+                return Value::Integer((int64_t)payload);
+            case kDouble: {
+                double d;
+                memcpy(&d, &payload, sizeof(d));
+                return Value::Double(d);
+            }
+            case kSymbol:
+                return Value(this->entry(symbols, payload));
+            case kObject:
+                return this->entry(objects, payload);
+        }
+        corrupt = true;
+        return nullptr;
+    }
+    template <typename T>
+    T* object(const Value& v) {
+        auto t = const_cast<T*>(dynamic_cast<const T*>(v.get()));
+        if (v && !t) {
+            corrupt = true;
+        }
+        return t;
+    }
+
+    // Makes the object, with whatever it refers to left for fill().
+    Value make() {
+        switch (this->next()) {
+            case kCons:
+                this->skip(4);
+                return make_cons(nullptr, nullptr);
+            case kNumber: {
+                bool isInt = this->next();
+                uint64_t bits = this->next();
+                double d;
+                memcpy(&d, &bits, sizeof(d));
+                return Value(new NumberValue(isInt ? Number((int64_t)bits) : Number(d)));
+            }
+            case kLocalRef: {
+                // Checked against the frames once they are filled in; see
+                // reaches().
+                const Symbol* s = this->symbol();
+                uint64_t depth = this->next();
+                uint64_t slot = this->next();
+                if (depth > INT_MAX || slot > INT_MAX) {
+                    corrupt = true;
+                }
+                return Value(new LocalRef(s, (int)depth, (int)slot));
+            }
+            case kGlobalRef:
+                return Value(new GlobalRef(this->symbol()));
+            case kLambda: {
+                auto c = this->code();
+                corrupt = corrupt || !c;
+                this->skip(2);
+                return Value(new LambdaProc(std::move(c), nullptr));
+            }
+            case kMakeClosure: {
+                auto c = this->code();
+                corrupt = corrupt || !c;
+                return Value(new MakeClosure(std::move(c)));
+            }
+            case kSetLocal:
+                return Value(new SetLocal((Procedure::Form)this->next()));
+            case kEnvironment: {
+                this->skip(4);  // outer code frozen
+                this->skip(2 * this->count(2));
+                this->skip(3 * this->count(3));
+                return Value(new Env);
+            }
+            case kBuiltin: {
+                // One this build does not have can not be loaded.
+                const Symbol* s = this->symbol();
+                auto i = s ? builtins.find(s->name) : builtins.end();
+                if (i == builtins.end()) {
+                    corrupt = true;
+                    return nullptr;
+                }
+                return i->second;
+            }
+            case kVector: {
+                bool isDouble = this->next();
+                uint64_t size = this->count();
+                this->skip(size);
+                return make_vector(isDouble, cursor - size, size);
+            }
+            case kHashTable:
+                this->skip(4 * this->count(4));
+                return make_hash_table();
+        }
+        corrupt = true;
+        return nullptr;
+    }
+
+    void fill(const Value& object) {
+        switch (this->next()) {
+            case kCons: {
+                Cons* cons = this->object<Cons>(object);
+                cons->left = this->value();
+                cons->right = this->value();
+                return;
+            }
+            case kLambda: {
+                LambdaProc* lambda = this->object<LambdaProc>(object);
+                this->next();
+                lambda->environment = Ref<Env>(this->object<Env>(this->value()));
+                corrupt = corrupt || !lambda->environment;
+                return;
+            }
+            case kEnvironment: {
+                Env* env = this->object<Env>(object);
+                env->outer = Ref<Env>(this->object<Env>(this->value()));
+                frames.push_back(env);
+                env->code = this->code();
+                env->frozen = this->next();
+                env->slots.resize(this->count(2));
+                for (Value& slot : env->slots) {
+                    slot = this->value();
+                }
+                size_t bindings = this->count(3);
+                env->map.reserve(bindings);
+                for (size_t i = 0; i < bindings; ++i) {
+                    const Symbol* s = this->symbol();
+                    env->map[s] = this->value();
+                }
+                return;
+            }
+            case kHashTable: {
+                size_t size = this->count(4);
+                for (size_t i = 0; i < size; ++i) {
+                    Value key = this->value();
+                    entries.emplace_back(object, std::make_pair(std::move(key), this->value()));
+                }
+                return;
+            }
+        }
+    }
+
+    // Whether each local reference in the lambda's body, and in the bodies of
+    // the lambdas made in it, names a slot of a frame it will have: its own,
+    // those of the lambdas it is made in, and then those of the lambda's
+    // environment.
+    bool reaches(const LambdaProc* lambda) {
+        struct Scope {
+            size_t slots;
+            const Scope* outer;
+        };
+        std::deque<Scope> scopes;
+        std::vector<Env*> chain;
+        for (Env* frame = lambda->environment.get(); frame; frame = frame->outer.get()) {
+            chain.push_back(frame);
+        }
+        const Scope* scope = nullptr;
+        for (auto i = chain.rbegin(); i != chain.rend(); ++i) {
+            scopes.push_back({(*i)->slots.size(), scope});
+            scope = &scopes.back();
+        }
+        const LambdaCode* code = lambda->code.get();
+        scopes.push_back({code->variables.size(), scope});
+        // Each lambda is written in one place, so is made in one scope.
+        std::unordered_map<const LambdaCode*, const Scope*> made = {{code, &scopes.back()}};
+        std::vector<std::pair<const Value*, const Scope*>> work = {{&code->body, &scopes.back()}};
+        // Quoted lists may be shared, or, in a corrupt image, cycles.
+        std::set<std::pair<const Cons*, const Scope*>> seen;
+        while (!work.empty()) {
+            const Value* value = work.back().first;
+            scope = work.back().second;
+            work.pop_back();
+            if (const LocalRef* ref = dcastLocalRef(*value)) {
+                for (int depth = ref->depth; scope && depth > 0; --depth) {
+                    scope = scope->outer;
+                }
+                if (!scope || (size_t)ref->slot >= scope->slots) {
+                    return false;
+                }
+            } else if (const Cons* cons = dcastCons(*value)) {
+                if (seen.emplace(cons, scope).second) {
+                    work.emplace_back(&cons->left, scope);
+                    work.emplace_back(&cons->right, scope);
+                }
+            } else if (auto closure = dynamic_cast<const MakeClosure*>(value->get())) {
+                code = closure->code.get();
+                auto i = made.find(code);
+                if (i == made.end()) {
+                    scopes.push_back({code->variables.size(), scope});
+                    i = made.emplace(code, &scopes.back()).first;
+                    work.emplace_back(&code->body, i->second);
+                } else if (i->second->outer != scope) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+public:
+    ImageReader(const uint64_t* begin, const uint64_t* e) : cursor(begin), end(e) {}
+
+    // Returns false if this is not an image this build can load: of another
+    // version, cut short or otherwise corrupt, or with a builtin this build
+    // does not have.
+    bool load(Environment* env) {
+        if (end - cursor < 5 || this->next() != kMagic || this->next() != kVersion) {
+            return false;
+        }
+        symbols.resize(this->count());
+        codes.resize(this->count());
+        objects.resize(this->count());
+        fields.resize(objects.size());
+        for (const Symbol*& s : symbols) {
+            uint64_t length = this->next();
+            uint64_t words = length / 8 + (length % 8 != 0);
+            if (words > (uint64_t)(end - cursor)) {
+                return false;
+            }
+            s = intern(std::string_view(reinterpret_cast<const char*>(cursor), length));
+            cursor += words;
+        }
+        for (auto& c : codes) {
+            c = std::make_shared<LambdaCode>();
+        }
+        const uint64_t* codeWords = cursor;
+        this->skipCodes();
+        Environment core = CoreEnvironemnt();
+        for (const auto& binding : core.impl->map) {
+            if (const Procedure* proc = dcastProcedure(binding.second)) {
+                std::ostringstream name;
+                proc->serialize(&name);
+                builtins.emplace(name.str(), binding.second);
+            }
+        }
+        for (size_t i = 0; i < objects.size() && !corrupt; ++i) {
+            fields[i] = cursor;
+            objects[i] = this->make();
+        }
+        if (corrupt) {
+            return false;
+        }
+        cursor = codeWords;
+        for (auto& c : codes) {
+            c->parameters = this->value();
+            c->arity = (int)this->next();
+            uint64_t name = this->next();
+            c->name = name == kNone ? nullptr : this->entry(symbols, name);
+            c->variables.resize(this->count());
+            for (const Symbol*& variable : c->variables) {
+                variable = this->symbol();
+            }
+            c->body = this->value();
+            // The arguments are copied into the first slots, and the body is
+            // a list of at least one form.
+            if (c->arity < 0 || (size_t)c->arity > c->variables.size() || !dcastCons(c->body)) {
+                corrupt = true;
+            }
+        }
+        for (size_t i = 0; i < objects.size(); ++i) {
+            cursor = fields[i];
+            this->fill(objects[i]);
+        }
+        if (corrupt || objects.empty()) {
+            return false;
+        }
+        for (auto& entry : entries) {
+            hash_table_set(entry.first, std::move(entry.second.first),
+                           std::move(entry.second.second));
+        }
+        // Outer frames may be filled in after the frames inside them.  A
+        // chain longer than there are frames goes around in a loop.
+        for (Env* frame : frames) {
+            frame->depth = 0;
+            for (Env* outer = frame->outer.get(); outer; outer = outer->outer.get()) {
+                if (++frame->depth > frames.size()) {
+                    return false;
+                }
+            }
+        }
+        for (const Value& object : objects) {
+            const Procedure* proc = dcastProcedure(object);
+            const LambdaProc* lambda = proc ? proc->asLambdaProc() : nullptr;
+            if (lambda && !this->reaches(lambda)) {
+                return false;
+            }
+        }
+        Env* top = this->object<Env>(objects[0]);
+        if (!top) {
+            return false;
+        }
+        env->impl = Ref<Env>(top);
+        ++gGlobalVersion;
+        return true;
+    }
+
+private:
+    void skipCodes() {
+        for (size_t i = 0; i < codes.size() && !corrupt; ++i) {
+            this->skip(2);  // parameters
+            this->skip(2);  // arity, name
+            this->skip(this->count());  // variables
+            this->skip(2);  // body
+        }
+    }
+};
+
+}  // namespace
+
+bool dissemblance::SaveImage(const Environment& env, const char* path) {
+    std::vector<uint64_t> image = ImageWriter().save(env);
+    if (image.empty()) {
+        errno = EINVAL;  // refers to what can not be saved.
+        return false;
+    }
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    bool written = image.size() == fwrite(image.data(), sizeof(uint64_t), image.size(), file);
+    return 0 == fclose(file) && written;
+}
+
+bool dissemblance::LoadImage(const char* path, Environment* env) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t size = (size_t)info.st_size;
+    void* data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    const uint64_t* words = static_cast<const uint64_t*>(data);
+    bool loaded = ImageReader(words, words + size / sizeof(uint64_t)).load(env);
+    if (data) {
+        munmap(data, size);
+    }
+    if (!loaded) {
+        errno = EINVAL;  // not an image.
+    }
+    return loaded;
+}
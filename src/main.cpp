@@ -3,18 +3,284 @@
 
 #include "dissemblance.h"
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <thread>
 
-int main() {
-    auto env = dissemblance::CoreEnvironemnt();
-    while (true) {
-        auto expr = dissemblance::Parse(&std::cin);
-        if (expr) {
-            auto val = dissemblance::Eval(expr, env);
-            dissemblance::Expression::Serialize(val.get(), &std::cout);
-            std::cout << std::endl;
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Runs each file as a script, or else each script framed on stdin as its
+// length in bytes, a newline, and its text.  Output is framed the same way
+// when the scripts are.  Returns false if a script could not be read.
+bool serve(const dissemblance::Environment& env, const std::vector<const char*>& paths,
+          int threads, bool vm) {
+    bool framed = paths.empty();
+    dissemblance::BatchServer server(env, threads, vm, [framed](std::string_view output) {
+        if (framed) {
+            std::cout << output.size() << '\n';
+        }
+        std::cout << output;
+        std::cout.flush();
+    });
+    if (framed) {
+        size_t length;
+        while (std::cin >> length && std::cin.get() == '\n') {
+            std::string script(length, '\0');
+            if (!std::cin.read(&script[0], (std::streamsize)length)) {
+                std::cerr << "stdin: script cut short\n";
+                return false;
+            }
+            server.submit(std::move(script));
+        }
+    } else {
+        for (const char* path : paths) {
+            std::ifstream file(path, std::ios::binary);
+            if (!file) {
+                perror(path);
+                return false;
+            }
+            std::ostringstream script;
+            script << file.rdbuf();
+            server.submit(script.str());
+        }
+    }
+    auto stats = server.finish();
+    auto latencies = stats.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    auto milliseconds = [&](double fraction) {
+        if (latencies.empty()) {
+            return 0.0;
+        }
+        size_t index = std::min(latencies.size() - 1, (size_t)(fraction * latencies.size()));
+        return latencies[index].count() / 1e6;
+    };
+    double seconds = stats.elapsed.count() / 1e9;
+    std::cerr << std::fixed << std::setprecision(3)
+              << "scripts: " << stats.requests
+              << "\nseconds: " << seconds
+              << "\nscripts per second: " << (seconds > 0 ? stats.requests / seconds : 0)
+              << "\nlatency (ms): p50 " << milliseconds(0.5)
+              << ", p90 " << milliseconds(0.9)
+              << ", p99 " << milliseconds(0.99)
+              << ", max " << milliseconds(1) << "\n";
+    return true;
+}
+
+void write_heap_stats() {
+    auto stats = dissemblance::GetHeapStats();
+    std::cerr << "heap: " << stats.conses << " conses, " << stats.numbers << " numbers, "
+              << stats.symbols << " symbols, " << stats.lambdas << " lambdas, "
+              << stats.frames << " frames, " << stats.objects << " objects; "
+              << stats.bytesLive << " bytes live (peak " << stats.peakBytesLive << "); "
+              << "deepest frame " << stats.deepestFrame << "\n";
+}
+
+// Writes the heap stats every `period` while the program runs, and once
+// more when it ends.
+class HeapStatsWriter {
+    std::mutex lock;
+    std::condition_variable ended;
+    bool done = false;
+    std::thread thread;
+
+public:
+    HeapStatsWriter(std::chrono::milliseconds period) {
+        if (period.count() > 0) {
+            thread = std::thread([this, period] {
+                std::unique_lock<std::mutex> l(lock);
+                while (!ended.wait_for(l, period, [this] { return done; })) {
+                    write_heap_stats();
+                }
+            });
+        }
+    }
+    ~HeapStatsWriter() {
+        if (thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> l(lock);
+                done = true;
+            }
+            ended.notify_one();
+            thread.join();
+        }
+        write_heap_stats();
+    }
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    bool vm = false;
+    bool gcStats = false;
+    bool allocStats = false;
+    int heapStats = -1;  // milliseconds between heap stats, or none.
+    bool batch = false;
+    bool profile = false;
+    bool server = false;
+    const char* image = nullptr;
+    const char* saveImage = nullptr;
+    int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    std::vector<const char*> paths;
+    bool usage = false;
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--vm")) {
+            vm = true;
+        } else if (0 == strcmp(argv[i], "--gc-stats")) {
+            gcStats = true;
+        } else if (0 == strcmp(argv[i], "--alloc-stats")) {
+            allocStats = true;
+        } else if (0 == strcmp(argv[i], "--heap-stats") && i + 1 < argc &&
+                   atoi(argv[i + 1]) >= 0) {
+            heapStats = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--hash-cons")) {
+            dissemblance::gHashConsing = true;
+        } else if (0 == strcmp(argv[i], "--batch")) {
+            batch = true;
+        } else if (0 == strcmp(argv[i], "--profile")) {
+            profile = true;
+        } else if (0 == strcmp(argv[i], "--image") && i + 1 < argc) {
+            image = argv[++i];
+        } else if (0 == strcmp(argv[i], "--save-image") && i + 1 < argc) {
+            saveImage = argv[++i];
+        } else if (0 == strcmp(argv[i], "--serve")) {
+            server = true;
+        } else if (0 == strcmp(argv[i], "--threads") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            threads = atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            paths.push_back(argv[i]);
         } else {
-            break;
+            usage = true;
+        }
+    }
+    if (usage || (paths.size() > 1 && !server)) {
+        std::cerr << "usage: " << argv[0]
+                  << " [--vm] [--batch] [--hash-cons] [--profile] [--gc-stats] [--alloc-stats]"
+                     " [--heap-stats MS] [--image in.image] [--save-image out.image]"
+                     " [program.scm]\n"
+                  << "       " << argv[0]
+                  << " --serve [--threads N] [--vm] [--hash-cons] [--profile] [--heap-stats MS]"
+                     " [--image in.image] [script.scm...]\n";
+        return 1;
+    }
+    const char* path = paths.empty() ? nullptr : paths[0];
+    dissemblance::Environment env;
+    if (!image) {
+        env = dissemblance::CoreEnvironemnt();
+    } else if (!dissemblance::LoadImage(image, &env)) {
+        perror(image);
+        return 1;
+    }
+    if (profile) {
+        dissemblance::StartProfiling();
+        threads = 1;  // the profiler counts one thread's calls.
+    }
+    // In batch mode, results are written only as the buffer fills.
+    dissemblance::Writer writer(&std::cout);
+    auto print = [&](const dissemblance::Value& expr) {
+        auto val = vm ? dissemblance::Run(dissemblance::Compile(expr, env), env)
+                      : dissemblance::Eval(expr, env);
+        writer.write(val);
+        writer.write('\n');
+        if (!batch) {
+            writer.flush();
+            std::cout.flush();
+        }
+    };
+    std::optional<HeapStatsWriter> heapStatsWriter;
+    if (heapStats >= 0) {
+        heapStatsWriter.emplace(std::chrono::milliseconds(heapStats));
+    }
+    if (server) {
+        if (!serve(env, paths, threads, vm)) {
+            return 1;
+        }
+    } else if (path) {
+        // Parse straight out of the mapped file.
+        int fd = open(path, O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            perror(path);
+            return 1;
+        }
+        size_t size = (size_t)info.st_size;
+        void* data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        close(fd);
+        if (data == MAP_FAILED) {
+            perror(path);
+            return 1;
+        }
+        const char* cursor = size ? static_cast<const char*>(data) : "";
+        const char* end = cursor + size;
+        if (const char* cache = getenv("DISSEMBLANCE_CACHE")) {
+            auto exprs = dissemblance::ParseAll(std::string_view(cursor, size), cache);
+            for (auto& expr : exprs) {
+                print(expr);
+                expr = nullptr;
+            }
+        } else {
+            while (auto expr = dissemblance::Parse(&cursor, end)) {
+                print(expr);
+            }
+        }
+        if (data) {
+            munmap(data, size);
+        }
+    } else {
+        while (auto expr = dissemblance::Parse(&std::cin)) {
+            print(expr);
+        }
+    }
+    writer.flush();
+    std::cout.flush();
+    heapStatsWriter.reset();
+    if (saveImage && !dissemblance::SaveImage(env, saveImage)) {
+        perror(saveImage);
+        return 1;
+    }
+    if (profile) {
+        dissemblance::WriteProfile(&std::cerr);
+    }
+    if (gcStats) {
+        auto stats = dissemblance::GetCollectorStats();
+        std::cerr << "collections: " << stats.collections
+                  << "\nobjects freed: " << stats.objectsFreed
+                  << "\nlive objects: " << stats.liveObjects
+                  << "\ntotal pause: " << stats.totalPause.count() / 1000 << " us"
+                  << "\nlongest pause: " << stats.longestPause.count() / 1000 << " us\n";
+    }
+    if (allocStats) {
+        auto stats = dissemblance::GetAllocatorStats();
+        uint64_t allocations = stats.largeAllocations;
+        for (const auto& sc : stats.sizeClasses) {
+            allocations += sc.allocations;
+        }
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        std::cerr << "allocations: " << allocations
+                  << "\npeak RSS: " << usage.ru_maxrss << " KB"
+                  << "\nslabs: " << stats.slabs << " (peak " << stats.peakSlabs
+                  << ", released " << stats.slabsReleased << ")"
+                  << "\nbytes in use: " << stats.bytesInUse
+                  << "\nlarge allocations: " << stats.largeAllocations << "\n";
+        for (const auto& sc : stats.sizeClasses) {
+            std::cerr << sc.objectSize << " bytes: " << sc.liveObjects << " live, "
+                      << sc.allocations << " allocated, " << sc.slabs << " slabs\n";
         }
     }
     return 0;
@@ -8,47 +8,111 @@
 #define number_DEFINED
 
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
-#include <sstream>
+#include <ostream>
+#include <string>
+#include <string_view>
 
 class Number {
 public:
     explicit Number(int v) : intValue(static_cast<int64_t>(v)), type(intType) {}
     explicit Number(double v) : doubleValue(v), type(doubleType) {}
     explicit Number(int64_t v) : intValue(v), type(intType) {}
-    explicit Number(const std::string& s) {
-        std::istringstream buffer(s);
-        if (nullptr != strchr(s.c_str(), '.') ||
-            nullptr != strchr(s.c_str(), 'E') ||
-            nullptr != strchr(s.c_str(), 'e')) {
-            buffer >> doubleValue;
-            type = doubleType;
-        } else {
-            buffer >> intValue;
-            type = intType;
+    // Parses the longest number at the start of `s`.  An integer too large
+    // for int64_t is read as a double.
+    explicit Number(std::string_view s) : intValue(0), type(intType) {
+        const char* end = s.data() + s.size();
+        if (s.find_first_of(".eE") == std::string_view::npos &&
+            std::from_chars(s.data(), end, intValue).ec != std::errc::result_out_of_range) {
+            return;
+        }
+        doubleValue = 0.0;
+        type = doubleType;
+        auto result = std::from_chars(s.data(), end, doubleValue);
+        if (result.ec == std::errc::result_out_of_range) {
+            // Too large is infinite and too small is zero, as strtod() has it.
+            doubleValue = std::strtod(std::string(s.data(), result.ptr).c_str(), nullptr);
         }
     }
-    void serialize(std::ostream* o) const {
+    bool isInt() const { return type == intType; }
+    int64_t asInt() const {
+        assert(type == intType);
+        return intValue;
+    }
+    double asDouble() const { return double(*this); }
+    // Enough room for any number toChars() writes.
+    static const int kMaxChars = 32;
+    // Writes the number as an ostream would into [first, last), and returns
+    // the end of what it wrote.
+    char* toChars(char* first, char* last) const {
+        std::to_chars_result result;
         switch (type) {
-            case intType: *o << intValue; return;
-            case doubleType: *o << doubleValue; return;
-            default: assert(false);
+            case intType:
+                result = std::to_chars(first, last, intValue);
+                break;
+            case doubleType:
+                result = std::to_chars(first, last, doubleValue,
+                                       std::chars_format::general, 6);
+                break;
+            default:
+                assert(false);
+                return first;
         }
+        assert(result.ec == std::errc());
+        return result.ptr;
+    }
+    void serialize(std::ostream* o) const {
+        char buffer[kMaxChars];
+        o->write(buffer, this->toChars(buffer, buffer + kMaxChars) - buffer);
+    }
+    // Integer arithmetic that overflows int64_t gives the result as a double.
+    // Each returns false, leaving *result alone, if it would overflow.
+    static bool Add(int64_t u, int64_t v, int64_t* result) {
+        int64_t r;
+        return !__builtin_add_overflow(u, v, &r) && (*result = r, true);
+    }
+    static bool Subtract(int64_t u, int64_t v, int64_t* result) {
+        int64_t r;
+        return !__builtin_sub_overflow(u, v, &r) && (*result = r, true);
+    }
+    static bool Multiply(int64_t u, int64_t v, int64_t* result) {
+        int64_t r;
+        return !__builtin_mul_overflow(u, v, &r) && (*result = r, true);
+    }
+    static bool Divide(int64_t u, int64_t v, int64_t* result) {
+        if (v == -1 && u == INT64_MIN) {
+            return false;
+        }
+        *result = u / v;
+        return true;
     }
     Number operator%(Number rhs) const {
-        return Number(BothInts(*this, rhs) ? intValue % rhs.intValue : 0);
+        return Number(BothInts(*this, rhs) && rhs.intValue != -1
+                      ? intValue % rhs.intValue : (int64_t)0);
     }
+    #define CHECKED_OPERATOR(OPERATOR, CHECKED)                    \
+        Number operator OPERATOR(Number rhs) const {               \
+            int64_t result;                                        \
+            return BothInts(*this, rhs) &&                         \
+                   CHECKED(intValue, rhs.intValue, &result)        \
+                ? Number(result)                                   \
+                : Number(double(*this) OPERATOR double(rhs));      \
+        }
+    CHECKED_OPERATOR(+, Add)
+    CHECKED_OPERATOR(-, Subtract)
+    CHECKED_OPERATOR(*, Multiply)
+    CHECKED_OPERATOR(/, Divide)
+    #undef CHECKED_OPERATOR
     #define INFIX_OPERATOR(RESULT_TYPE, OPERATOR)             \
         RESULT_TYPE operator OPERATOR(Number rhs) const {     \
             return BothInts(*this, rhs)                       \
                 ? Number(intValue OPERATOR rhs.intValue)      \
                 : Number(double(*this) OPERATOR double(rhs)); \
         }
-    INFIX_OPERATOR(Number, +)
-    INFIX_OPERATOR(Number, -)
-    INFIX_OPERATOR(Number, *)
-    INFIX_OPERATOR(Number, /)
     INFIX_OPERATOR(bool, ==)
     INFIX_OPERATOR(bool, >)
     INFIX_OPERATOR(bool, <)
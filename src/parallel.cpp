@@ -0,0 +1,306 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// Futures, and a parallel map, run on a pool of threads.
+//
+// Each thread has a deque of tasks.  A thread pushes the tasks it makes onto
+// its own deque and takes its newest task first; a thread with none left
+// steals the oldest task of another.  A thread waiting for a task to finish
+// runs other tasks meanwhile, or the task itself if nobody has started it, so
+// futures may be touched from inside tasks, and with one thread everything
+// still runs, in order, on the main thread.
+//
+// The pool starts the first time a task is made, with DISSEMBLANCE_THREADS
+// threads, or one per core.  From then on gThreaded is set, so reference
+// counts are changed atomically.  Tasks run with the tree-walking evaluator,
+// and only on the main thread while profiling.
+
+#include "dissemblance.h"
+#include "expression.h"
+
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace dissemblance;
+
+bool dissemblance::gThreaded = false;
+
+namespace {
+
+// Applications of a procedure: `(future thunk)` makes one that calls the
+// thunk, and pmap makes one for each slice of its list, which applies the
+// procedure to each element of the slice.
+struct Task : public Expression {
+    enum State { kQueued, kRunning, kDone };
+    Value procedure;
+    bool thunk;
+    std::vector<Value> arguments;
+    std::vector<Value> results;
+    std::atomic<int> state{kQueued};
+
+    Task(Value p, bool t) : procedure(std::move(p)), thunk(t) {}
+    void serialize(std::ostream* o) const override { *o << "#<future>"; }
+    void trace(Tracer* t) const override {
+        t->trace(procedure);
+        for (const Value& v : arguments) {
+            t->trace(v);
+        }
+        for (const Value& v : results) {
+            t->trace(v);
+        }
+    }
+    void clear() override {
+        procedure = nullptr;
+        arguments.clear();
+        results.clear();
+    }
+
+    // Whether this thread is the one to run the task.
+    bool claim() {
+        int queued = kQueued;
+        return state.compare_exchange_strong(queued, kRunning);
+    }
+    bool done() const { return state.load(std::memory_order_acquire) == kDone; }
+    void run() {
+        const Procedure* proc = dcastProcedure(procedure);
+        assert(proc);
+        if (thunk) {
+            results.push_back(proc->apply(nullptr, 0));
+        } else {
+            results.reserve(arguments.size());
+            for (const Value& argument : arguments) {
+                results.push_back(proc->apply(&argument, 1));
+            }
+        }
+        procedure = nullptr;
+        arguments.clear();
+        state.store(kDone, std::memory_order_release);
+    }
+};
+
+thread_local size_t tQueue = 0;  // the main thread's is first.
+
+class Pool {
+    struct Queue {
+        std::mutex lock;
+        std::deque<Ref<Task>> tasks;
+    };
+    std::vector<Queue> queues;
+    std::mutex lock;
+    std::condition_variable wake;
+    uint64_t events = 0;  // tasks made or finished.
+
+    Pool(size_t threads) : queues(threads) {}
+
+    void notify() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ++events;
+        }
+        wake.notify_all();
+    }
+    uint64_t seen() {
+        std::lock_guard<std::mutex> guard(lock);
+        return events;
+    }
+    void sleep(uint64_t since) {
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [&] { return events != since; });
+    }
+
+    Ref<Task> take() {
+        {
+            Queue& own = queues[tQueue];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                Ref<Task> task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return task;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); ++i) {
+            Queue& other = queues[(tQueue + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(other.lock);
+            if (!other.tasks.empty()) {
+                Ref<Task> task = std::move(other.tasks.front());
+                other.tasks.pop_front();
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    // Runs a task, if there is one to run.
+    bool runOne() {
+        RunningTask running;
+        Ref<Task> task = this->take();
+        if (!task) {
+            return false;
+        }
+        if (task->claim()) {
+            task->run();
+            this->notify();
+        }
+        return true;
+    }
+
+    void work(size_t queue) {
+        tQueue = queue;
+        while (true) {
+            uint64_t since = this->seen();
+            if (!this->runOne()) {
+                this->sleep(since);
+            }
+        }
+    }
+
+public:
+    static Pool* Get() {
+        static Pool* pool = Start();
+        return pool;
+    }
+
+    static Pool* Start() {
+        size_t threads = std::thread::hardware_concurrency();
+        if (const char* count = getenv("DISSEMBLANCE_THREADS")) {
+            threads = (size_t)atoi(count);
+        }
+        if (gProfiling || threads < 1) {
+            threads = 1;
+        }
+        // Never freed: workers wait on it until the program exits.
+        Pool* pool = new Pool(threads);
+        if (threads > 1) {
+            gThreaded = true;
+        }
+        for (size_t i = 1; i < threads; ++i) {
+            std::thread([pool, i] { pool->work(i); }).detach();
+        }
+        return pool;
+    }
+
+    size_t threads() const { return queues.size(); }
+
+    void submit(Ref<Task> task) {
+        Queue& own = queues[tQueue];
+        {
+            std::lock_guard<std::mutex> guard(own.lock);
+            own.tasks.push_back(std::move(task));
+        }
+        this->notify();
+    }
+
+    // Returns once `task` is done, running it or other tasks meanwhile.
+    void wait(Task* task) {
+        if (task->claim()) {
+            task->run();
+            this->notify();
+            return;
+        }
+        while (!task->done()) {
+            uint64_t since = this->seen();
+            if (task->done()) {
+                return;
+            }
+            if (!this->runOne()) {
+                this->sleep(since);
+            }
+        }
+    }
+};
+
+Task* to_task(const Value& value) {
+    return const_cast<Task*>(dynamic_cast<const Task*>(value.get()));
+}
+
+class ParallelProcedure : public Procedure {
+    const char* name;
+public:
+    ParallelProcedure(const char* n) : name(n) {}
+    void serialize(std::ostream* o) const override { *o << name; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+};
+
+// (future thunk): starts calling the thunk, and returns a future of its value.
+class Future : public ParallelProcedure {
+public:
+    Future() : ParallelProcedure("future") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(1 == count);
+        assert(dcastProcedure(args[0]));
+        Ref<Task> task(new Task(args[0], true));
+        Value future(task.get());
+        Pool::Get()->submit(std::move(task));
+        return future;
+    }
+};
+
+// (touch future): its value, once it has one.  Anything else is its own value.
+class Touch : public ParallelProcedure {
+public:
+    Touch() : ParallelProcedure("touch") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(1 == count);
+        Task* task = to_task(args[0]);
+        if (!task) {
+            return args[0];
+        }
+        Pool::Get()->wait(task);
+        return task->results[0];
+    }
+};
+
+// (pmap procedure list): `map`, with the elements split among the threads.
+class ParallelMap : public ParallelProcedure {
+    // Enough slices to balance the threads' work, if some take longer.
+    static const size_t kSlicesPerThread = 4;
+public:
+    ParallelMap() : ParallelProcedure("pmap") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(2 == count);
+        assert(dcastProcedure(args[0]));
+        std::vector<Value> elements;
+        for (const Cons* c = dcastCons(args[1]); c; c = dcastCons(c->right)) {
+            elements.push_back(c->left);
+        }
+        Pool* pool = Pool::Get();
+        size_t slices = std::min(elements.size(), kSlicesPerThread * pool->threads());
+        std::vector<Ref<Task>> tasks;
+        for (size_t i = 0; i < slices; ++i) {
+            Ref<Task> task(new Task(args[0], false));
+            task->arguments.assign(elements.begin() + elements.size() * i / slices,
+                                   elements.begin() + elements.size() * (i + 1) / slices);
+            tasks.push_back(task);
+            pool->submit(std::move(task));
+        }
+        Value list;
+        for (auto i = tasks.rbegin(); i != tasks.rend(); ++i) {
+            pool->wait(i->get());
+            const auto& results = (*i)->results;
+            for (auto r = results.rbegin(); r != results.rend(); ++r) {
+                list = make_cons(*r, std::move(list));
+            }
+        }
+        return list;
+    }
+};
+
+}  // namespace
+
+void dissemblance::add_parallel_procedures(Env* env) {
+    auto& map = env->map;
+    map[intern("future")] = Value(new Future);
+    map[intern("touch")] = Value(new Touch);
+    map[intern("pmap")] = Value(new ParallelMap);
+}
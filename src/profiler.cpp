@@ -0,0 +1,222 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// A profiler that both engines tell when procedures start and finish.
+//
+// Each call is counted in a tree of call paths.  Calls in tail position
+// replace the caller's frame, as they do in the evaluator, so a loop written
+// as tail recursion stays one node deep.  The flat profile adds up each
+// procedure's nodes, counting a recursive procedure's inclusive time only at
+// its outermost call.
+
+#include "dissemblance.h"
+#include "expression.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+using namespace dissemblance;
+
+bool dissemblance::gProfiling = false;
+size_t dissemblance::gTailMark = 0;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Nanoseconds = std::chrono::nanoseconds;
+
+struct Node {
+    const Symbol* name;  // interned, so names compare by address.
+    bool builtin;
+    Node* parent;
+    std::vector<Node*> children;
+    uint64_t calls = 0;
+    Nanoseconds inclusive{0};
+    Nanoseconds exclusive{0};
+
+    Node(const Symbol* n, bool b, Node* p) : name(n), builtin(b), parent(p) {}
+    Node* child(const Symbol* n, bool b) {
+        for (Node* c : children) {
+            if (c->name == n && c->builtin == b) {
+                return c;
+            }
+        }
+        children.push_back(new Node(n, b, this));
+        return children.back();
+    }
+};
+
+struct Frame {
+    Node* node;
+    Clock::time_point start;
+    Nanoseconds inChildren;
+};
+
+Node* gRoot;
+Node* gCurrent;
+std::vector<Frame>* gFrames;
+// The name of each builtin seen, which is kept so its address is not reused.
+std::unordered_map<const Procedure*, std::pair<Value, const Symbol*>>* gBuiltins;
+
+const Symbol* name_of(const Procedure* proc, bool* builtin) {
+    if (const LambdaProc* lambda = proc->asLambdaProc()) {
+        *builtin = false;
+        const LambdaCode& code = *lambda->code;
+        if (code.name) {
+            return code.name;
+        }
+        if (!code.profileName) {
+            std::ostringstream text;
+            text << "(lambda ";
+            Expression::Serialize(code.parameters, &text);
+            text << ")";
+            code.profileName = intern(text.str());
+        }
+        return code.profileName;
+    }
+    *builtin = true;
+    auto i = gBuiltins->find(proc);
+    if (i == gBuiltins->end()) {
+        std::ostringstream text;
+        proc->serialize(&text);
+        i = gBuiltins->emplace(proc, std::make_pair(Value(proc), intern(text.str()))).first;
+    }
+    return i->second.second;
+}
+
+std::string seconds(Nanoseconds t) {
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(6) << t.count() / 1e9;
+    return text.str();
+}
+
+}  // namespace
+
+size_t dissemblance::profile_depth() { return gFrames->size(); }
+
+void dissemblance::profile_enter(const Procedure* proc) {
+    bool builtin;
+    const Symbol* name = name_of(proc, &builtin);
+    gCurrent = gCurrent->child(name, builtin);
+    ++gCurrent->calls;
+    gFrames->push_back(Frame{gCurrent, Clock::now(), Nanoseconds(0)});
+}
+
+void dissemblance::profile_exit_to(size_t depth) {
+    if (gFrames->size() <= depth) {
+        return;
+    }
+    auto now = Clock::now();
+    while (gFrames->size() > depth) {
+        const Frame& frame = gFrames->back();
+        auto elapsed = std::chrono::duration_cast<Nanoseconds>(now - frame.start);
+        frame.node->inclusive += elapsed;
+        frame.node->exclusive += elapsed - frame.inChildren;
+        gFrames->pop_back();
+        if (!gFrames->empty()) {
+            gFrames->back().inChildren += elapsed;
+        }
+        gCurrent = frame.node->parent;
+    }
+}
+
+void dissemblance::StartProfiling() {
+    if (!gRoot) {
+        gRoot = new Node(nullptr, false, nullptr);
+        gFrames = new std::vector<Frame>;
+        gBuiltins = new std::unordered_map<const Procedure*,
+                                           std::pair<Value, const Symbol*>>;
+    }
+    gCurrent = gRoot;
+    gProfiling = true;
+}
+
+void dissemblance::WriteProfile(std::ostream* o) {
+    if (!gRoot) {
+        return;
+    }
+    profile_exit_to(0);
+
+    struct Flat {
+        uint64_t calls = 0;
+        Nanoseconds inclusive{0};
+        Nanoseconds exclusive{0};
+    };
+    std::map<std::pair<bool, std::string>, Flat> flat;
+    Nanoseconds total{0};
+    for (Node* top : gRoot->children) {
+        total += top->inclusive;
+    }
+    // Walk the tree, without recursion, since it is as deep as the program's
+    // deepest non-tail recursion.
+    std::vector<Node*> stack(gRoot->children.rbegin(), gRoot->children.rend());
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        Flat& f = flat[std::make_pair(node->builtin, node->name->name)];
+        f.calls += node->calls;
+        f.exclusive += node->exclusive;
+        bool outermost = true;
+        for (Node* n = node->parent; n != gRoot; n = n->parent) {
+            if (n->name == node->name && n->builtin == node->builtin) {
+                outermost = false;
+                break;
+            }
+        }
+        if (outermost) {
+            f.inclusive += node->inclusive;
+        }
+        stack.insert(stack.end(), node->children.rbegin(), node->children.rend());
+    }
+
+    for (bool builtin : {false, true}) {
+        *o << (builtin ? "\nbuiltins" : "lambdas")
+           << ":\n       calls   inclusive   exclusive  procedure\n";
+        std::vector<std::pair<std::string, Flat>> rows;
+        for (const auto& entry : flat) {
+            if (entry.first.first == builtin) {
+                rows.emplace_back(entry.first.second, entry.second);
+            }
+        }
+        std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+            return a.second.exclusive > b.second.exclusive;
+        });
+        for (const auto& row : rows) {
+            *o << std::setw(12) << row.second.calls
+               << std::setw(12) << seconds(row.second.inclusive)
+               << std::setw(12) << seconds(row.second.exclusive)
+               << "  " << row.first << "\n";
+        }
+    }
+
+    // Paths that took at least 1% of the time.
+    *o << "\ncall tree:\n       calls   inclusive   exclusive  procedure\n";
+    std::vector<std::pair<Node*, int>> tree;
+    auto push_children = [&](Node* node, int depth) {
+        std::vector<Node*> children = node->children;
+        std::sort(children.begin(), children.end(), [](Node* a, Node* b) {
+            return a->inclusive < b->inclusive;
+        });
+        for (Node* child : children) {
+            if (child->inclusive * 100 >= total) {
+                tree.emplace_back(child, depth);
+            }
+        }
+    };
+    push_children(gRoot, 0);
+    while (!tree.empty()) {
+        Node* node = tree.back().first;
+        int depth = tree.back().second;
+        tree.pop_back();
+        *o << std::setw(12) << node->calls
+           << std::setw(12) << seconds(node->inclusive)
+           << std::setw(12) << seconds(node->exclusive)
+           << "  " << std::string(2 * depth, ' ') << node->name->name
+           << (node->builtin ? " (builtin)" : "") << "\n";
+        push_children(node, depth + 1);
+    }
+}
@@ -0,0 +1,161 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// Runs many short scripts at once, so that they share one process and one
+// core environment rather than each paying to start up.
+//
+// Each script gets a new environment over the frozen core, so what one
+// script defines no other sees, and the core's bindings are read without
+// locking.  Scripts are taken in order by whichever thread is free, and each
+// thread that finishes one writes out every finished script that is next in
+// line.
+//
+// A script runs as a task, so the collector can not run during one.  Every
+// so often the thread finishing a script waits for the others to finish
+// theirs, and collects the cycles the scripts left behind.
+
+#include "dissemblance.h"
+#include "expression.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+using namespace dissemblance;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+const uint64_t kScriptsPerCollection = 256;
+
+struct Script {
+    std::string text;
+    Clock::time_point submitted;
+    std::string output;
+    bool done = false;
+    explicit Script(std::string t) : text(std::move(t)), submitted(Clock::now()) {}
+};
+}  // namespace
+
+struct dissemblance::BatchServer::Impl {
+    Environment core;
+    bool vm;
+    std::function<void(std::string_view)> output;
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread> threads;
+
+    std::mutex lock;  // guards the rest.
+    std::condition_variable wake;  // a script to run, the end, or a collection finished.
+    std::condition_variable idle;  // no script is running.
+    std::deque<Script> scripts;  // from the first not yet written out.
+    uint64_t written = 0;  // scripts before the first of `scripts`.
+    uint64_t started = 0;
+    uint64_t running = 0;
+    uint64_t finished = 0;
+    bool collecting = false;
+    bool finishing = false;
+    Stats stats;
+
+    std::string run(const std::string& text) {
+        RunningTask task;
+        Environment env = Extend(core);
+        std::ostringstream out;
+        Writer writer(&out);
+        const char* cursor = text.data();
+        const char* end = cursor + text.size();
+        while (auto expr = Parse(&cursor, end)) {
+            writer.write(vm ? Run(Compile(expr, env), env) : Eval(expr, env));
+            writer.write('\n');
+        }
+        writer.flush();
+        return out.str();
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&] {
+                bool waiting = started < written + scripts.size();
+                return (waiting && !collecting) || (!waiting && finishing);
+            });
+            if (started == written + scripts.size()) {
+                return;
+            }
+            Script& script = scripts[started++ - written];
+            ++running;
+            guard.unlock();
+            std::string result = this->run(script.text);
+            guard.lock();
+            script.output = std::move(result);
+            script.done = true;
+            --running;
+            while (!scripts.empty() && scripts.front().done) {
+                output(scripts.front().output);
+                stats.latencies.push_back(Clock::now() - scripts.front().submitted);
+                scripts.pop_front();
+                ++written;
+            }
+            if (0 == ++finished % kScriptsPerCollection && !collecting) {
+                this->collect(guard);
+            } else if (0 == running) {
+                idle.notify_all();
+            }
+        }
+    }
+
+    void collect(std::unique_lock<std::mutex>& guard) {
+        collecting = true;
+        idle.wait(guard, [&] { return 0 == running; });
+        guard.unlock();
+        CollectGarbage();
+        guard.lock();
+        collecting = false;
+        wake.notify_all();
+    }
+};
+
+dissemblance::BatchServer::BatchServer(
+        Environment core, int threads, bool vm,
+        std::function<void(std::string_view)> output)
+    : impl(new Impl) {
+    assert(threads > 0);
+    Freeze(core);
+    impl->core = std::move(core);
+    impl->vm = vm;
+    impl->output = std::move(output);
+    gThreaded = true;
+    for (int i = 0; i < threads; ++i) {
+        impl->threads.emplace_back([this] { impl->work(); });
+    }
+}
+
+dissemblance::BatchServer::~BatchServer() {
+    this->finish();
+}
+
+void dissemblance::BatchServer::submit(std::string text) {
+    {
+        std::lock_guard<std::mutex> guard(impl->lock);
+        assert(!impl->finishing);
+        impl->scripts.emplace_back(std::move(text));
+    }
+    impl->wake.notify_one();
+}
+
+BatchServer::Stats dissemblance::BatchServer::finish() {
+    {
+        std::lock_guard<std::mutex> guard(impl->lock);
+        impl->finishing = true;
+    }
+    impl->wake.notify_all();
+    for (std::thread& thread : impl->threads) {
+        thread.join();
+    }
+    impl->threads.clear();
+    Stats stats = impl->stats;
+    stats.requests = stats.latencies.size();
+    stats.elapsed = Clock::now() - impl->start;
+    return stats;
+}
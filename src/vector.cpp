@@ -0,0 +1,551 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// Vectors of numbers, held unboxed in one contiguous array, and the
+// procedures on them.
+//
+// A vector holds integers until a double is stored in it, and from then on
+// holds doubles.  Operations on whole vectors run kernels written for the
+// widest SIMD instructions the machine has, chosen when first used; setting
+// DISSEMBLANCE_SIMD to avx2, sse4.2 or scalar chooses a narrower set.
+// Integer kernels check for overflow, and an overflowing integer result is
+// computed again as doubles, as the arithmetic procedures do.
+//
+// A vector may be shared between threads, and storing a double in one of
+// integers replaces its array, so once they may be running, each operation
+// holds the vector's lock.
+
+#include "dissemblance.h"
+#include "expression.h"
+#include "number.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DISSEMBLANCE_X86 1
+#endif
+
+using namespace dissemblance;
+
+namespace {
+
+enum Arithmetic { kAdd, kSubtract, kMultiply };
+enum Comparison { kLess, kEqual, kGreater };
+
+struct Kernels {
+    const char* name;
+    bool (*sumInts)(const int64_t*, size_t, int64_t*);
+    bool (*addInts[2])(const int64_t*, const int64_t*, int64_t*, size_t);  // +, -
+    int64_t (*extremeInts[2])(const int64_t*, size_t);  // min, max
+    void (*compareInts[3])(const int64_t*, const int64_t*, int64_t*, size_t);
+    double (*sumDoubles)(const double*, size_t);
+    double (*dotDoubles)(const double*, const double*, size_t);
+    double (*extremeDoubles[2])(const double*, size_t);
+    void (*arithmeticDoubles[3])(const double*, const double*, double*, size_t);
+    void (*compareDoubles[3])(const double*, const double*, int64_t*, size_t);
+};
+
+namespace scalar {
+struct Isa {
+    static constexpr const char* kName = "scalar";
+    static constexpr size_t kLanes = 1;
+    typedef double D;
+    typedef int64_t I;  // a mask is all ones or all zeros.
+    static D zero() { return 0.0; }
+    static D load(const double* p) { return *p; }
+    static void store(double* p, D v) { *p = v; }
+    static D add(D a, D b) { return a + b; }
+    static D sub(D a, D b) { return a - b; }
+    static D mul(D a, D b) { return a * b; }
+    static D min(D a, D b) { return std::min(a, b); }
+    static D max(D a, D b) { return std::max(a, b); }
+    static double sum(D v) { return v; }
+    static I lt(D a, D b) { return a < b; }
+    static I eq(D a, D b) { return a == b; }
+    static I zeroi() { return 0; }
+    static I loadi(const int64_t* p) { return *p; }
+    static void storei(int64_t* p, I v) { *p = v; }
+    // Wrapping, as the vector instructions do; callers check for overflow.
+    static I addi(I a, I b) { return (int64_t)((uint64_t)a + (uint64_t)b); }
+    static I subi(I a, I b) { return (int64_t)((uint64_t)a - (uint64_t)b); }
+    static I andi(I a, I b) { return a & b; }
+    static I ori(I a, I b) { return a | b; }
+    static I xori(I a, I b) { return a ^ b; }
+    static bool negative(I v) { return v < 0; }
+    static I gti(I a, I b) { return a > b ? -1 : 0; }
+    static I eqi(I a, I b) { return a == b ? -1 : 0; }
+    static I one(I mask) { return mask & 1; }
+    static I select(I mask, I a, I b) { return mask ? a : b; }
+};
+#include "vector_kernels.h"
+}  // namespace scalar
+
+#ifdef DISSEMBLANCE_X86
+
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+namespace sse42 {
+struct Isa {
+    static constexpr const char* kName = "sse4.2";
+    static constexpr size_t kLanes = 2;
+    typedef __m128d D;
+    typedef __m128i I;
+    static D zero() { return _mm_setzero_pd(); }
+    static D load(const double* p) { return _mm_loadu_pd(p); }
+    static void store(double* p, D v) { _mm_storeu_pd(p, v); }
+    static D add(D a, D b) { return _mm_add_pd(a, b); }
+    static D sub(D a, D b) { return _mm_sub_pd(a, b); }
+    static D mul(D a, D b) { return _mm_mul_pd(a, b); }
+    static D min(D a, D b) { return _mm_min_pd(a, b); }
+    static D max(D a, D b) { return _mm_max_pd(a, b); }
+    static double sum(D v) { return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v))); }
+    static I lt(D a, D b) { return one(_mm_castpd_si128(_mm_cmplt_pd(a, b))); }
+    static I eq(D a, D b) { return one(_mm_castpd_si128(_mm_cmpeq_pd(a, b))); }
+    static I zeroi() { return _mm_setzero_si128(); }
+    static I loadi(const int64_t* p) { return _mm_loadu_si128((const __m128i*)p); }
+    static void storei(int64_t* p, I v) { _mm_storeu_si128((__m128i*)p, v); }
+    static I addi(I a, I b) { return _mm_add_epi64(a, b); }
+    static I subi(I a, I b) { return _mm_sub_epi64(a, b); }
+    static I andi(I a, I b) { return _mm_and_si128(a, b); }
+    static I ori(I a, I b) { return _mm_or_si128(a, b); }
+    static I xori(I a, I b) { return _mm_xor_si128(a, b); }
+    static bool negative(I v) { return 0 != _mm_movemask_pd(_mm_castsi128_pd(v)); }
+    static I gti(I a, I b) { return _mm_cmpgt_epi64(a, b); }
+    static I eqi(I a, I b) { return _mm_cmpeq_epi64(a, b); }
+    static I one(I mask) { return _mm_srli_epi64(mask, 63); }
+    static I select(I mask, I a, I b) { return _mm_blendv_epi8(b, a, mask); }
+};
+#include "vector_kernels.h"
+}  // namespace sse42
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+namespace avx2 {
+struct Isa {
+    static constexpr const char* kName = "avx2";
+    static constexpr size_t kLanes = 4;
+    typedef __m256d D;
+    typedef __m256i I;
+    static D zero() { return _mm256_setzero_pd(); }
+    static D load(const double* p) { return _mm256_loadu_pd(p); }
+    static void store(double* p, D v) { _mm256_storeu_pd(p, v); }
+    static D add(D a, D b) { return _mm256_add_pd(a, b); }
+    static D sub(D a, D b) { return _mm256_sub_pd(a, b); }
+    static D mul(D a, D b) { return _mm256_mul_pd(a, b); }
+    static D min(D a, D b) { return _mm256_min_pd(a, b); }
+    static D max(D a, D b) { return _mm256_max_pd(a, b); }
+    static double sum(D v) {
+        __m128d half = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+        return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+    }
+    static I lt(D a, D b) { return one(_mm256_castpd_si256(_mm256_cmp_pd(a, b, _CMP_LT_OQ))); }
+    static I eq(D a, D b) { return one(_mm256_castpd_si256(_mm256_cmp_pd(a, b, _CMP_EQ_OQ))); }
+    static I zeroi() { return _mm256_setzero_si256(); }
+    static I loadi(const int64_t* p) { return _mm256_loadu_si256((const __m256i*)p); }
+    static void storei(int64_t* p, I v) { _mm256_storeu_si256((__m256i*)p, v); }
+    static I addi(I a, I b) { return _mm256_add_epi64(a, b); }
+    static I subi(I a, I b) { return _mm256_sub_epi64(a, b); }
+    static I andi(I a, I b) { return _mm256_and_si256(a, b); }
+    static I ori(I a, I b) { return _mm256_or_si256(a, b); }
+    static I xori(I a, I b) { return _mm256_xor_si256(a, b); }
+    static bool negative(I v) { return 0 != _mm256_movemask_pd(_mm256_castsi256_pd(v)); }
+    static I gti(I a, I b) { return _mm256_cmpgt_epi64(a, b); }
+    static I eqi(I a, I b) { return _mm256_cmpeq_epi64(a, b); }
+    static I one(I mask) { return _mm256_srli_epi64(mask, 63); }
+    static I select(I mask, I a, I b) { return _mm256_blendv_epi8(b, a, mask); }
+};
+#include "vector_kernels.h"
+}  // namespace avx2
+#pragma GCC pop_options
+
+#endif  // DISSEMBLANCE_X86
+
+const Kernels* choose_kernels() {
+    std::vector<const Kernels*> supported;
+#ifdef DISSEMBLANCE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        supported.push_back(&avx2::kKernels);
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        supported.push_back(&sse42::kKernels);
+    }
+#endif
+    supported.push_back(&scalar::kKernels);
+    if (const char* name = getenv("DISSEMBLANCE_SIMD")) {
+        for (const Kernels* k : supported) {
+            if (0 == strcmp(name, k->name)) {
+                return k;
+            }
+        }
+    }
+    return supported.front();
+}
+
+const Kernels& kernels() {
+    static const Kernels* chosen = choose_kernels();
+    return *chosen;
+}
+
+struct Vector : public Expression {
+    mutable bool isDouble = false;
+    mutable std::vector<int64_t> ints;  // until isDouble.
+    mutable std::vector<double> doubles;
+    mutable std::mutex lock;
+
+    std::unique_lock<std::mutex> hold() const {
+        std::unique_lock<std::mutex> l(lock, std::defer_lock);
+        if (gThreaded) {
+            l.lock();
+        }
+        return l;
+    }
+
+    size_t size() const { return isDouble ? doubles.size() : ints.size(); }
+    Number get(size_t i) const {
+        assert(i < this->size());
+        return isDouble ? Number(doubles[i]) : Number(ints[i]);
+    }
+    void set(size_t i, Number n) const {
+        assert(i < this->size());
+        if (!isDouble && !n.isInt()) {
+            this->toDoubles();
+        }
+        if (isDouble) {
+            doubles[i] = n.asDouble();
+        } else {
+            ints[i] = n.asInt();
+        }
+    }
+    void toDoubles() const {
+        doubles.assign(ints.begin(), ints.end());
+        ints = std::vector<int64_t>();
+        isDouble = true;
+    }
+    // The elements as doubles, copied into `scratch` if they are integers.
+    const double* asDoubles(std::vector<double>* scratch) const {
+        if (isDouble) {
+            return doubles.data();
+        }
+        scratch->assign(ints.begin(), ints.end());
+        return scratch->data();
+    }
+    void serialize(std::ostream* o) const override {
+        auto held = this->hold();
+        *o << "#(";
+        for (size_t i = 0; i < this->size(); ++i) {
+            if (i > 0) {
+                *o << ' ';
+            }
+            this->get(i).serialize(o);
+        }
+        *o << ')';
+    }
+};
+
+const Vector* to_vector(const Value& value) {
+    auto vector = dynamic_cast<const Vector*>(value.get());
+    assert(vector);  // is a vector
+    return vector;
+}
+
+size_t to_index(const Value& value) {
+    int64_t i = to_number(value).asInt();
+    assert(i >= 0);
+    return (size_t)i;
+}
+
+typedef std::pair<std::unique_lock<std::mutex>, std::unique_lock<std::mutex>> Held;
+
+// Two vectors of the same length, held in address order, so that threads
+// holding the same two can not deadlock, and only once if they are one.
+Held check_pair(const Value* args, int count, const Vector** u, const Vector** v) {
+    assert(2 == count);
+    *u = to_vector(args[0]);
+    *v = to_vector(args[1]);
+    Held held;
+    if (*u == *v) {
+        held.first = (*u)->hold();
+    } else {
+        held.first = std::min(*u, *v)->hold();
+        held.second = std::max(*u, *v)->hold();
+    }
+    assert((*u)->size() == (*v)->size());
+    return held;
+}
+
+class VectorProcedure : public Procedure {
+    const char* name;
+public:
+    VectorProcedure(const char* n) : name(n) {}
+    void serialize(std::ostream* o) const override { *o << name; }
+    Value eval(
+            const Value& expr,
+            Ref<Env>& env) const override {
+        return eval_apply(this, expr, env);
+    }
+};
+
+// (make-vector length [fill])
+class MakeVector : public VectorProcedure {
+public:
+    MakeVector() : VectorProcedure("make-vector") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(1 == count || 2 == count);
+        size_t size = to_index(args[0]);
+        Number fill = count == 2 ? to_number(args[1]) : Number(0);
+        auto vector = new Vector;
+        if (fill.isInt()) {
+            vector->ints.assign(size, fill.asInt());
+        } else {
+            vector->isDouble = true;
+            vector->doubles.assign(size, fill.asDouble());
+        }
+        return Value(vector);
+    }
+};
+
+// (vector element ...)
+class VectorOf : public VectorProcedure {
+public:
+    VectorOf() : VectorProcedure("vector") {}
+    Value apply(
+            const Value* args, int count) const override {
+        auto vector = new Vector;
+        vector->ints.resize(count);
+        for (int i = 0; i < count; ++i) {
+            vector->set(i, to_number(args[i]));
+        }
+        return Value(vector);
+    }
+};
+
+class VectorRef : public VectorProcedure {
+public:
+    VectorRef() : VectorProcedure("vector-ref") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(2 == count);
+        const Vector* v = to_vector(args[0]);
+        size_t i = to_index(args[1]);
+        auto held = v->hold();
+        return make_number(v->get(i));
+    }
+};
+
+class VectorSet : public VectorProcedure {
+public:
+    VectorSet() : VectorProcedure("vector-set!") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(3 == count);
+        const Vector* v = to_vector(args[0]);
+        size_t i = to_index(args[1]);
+        Number n = to_number(args[2]);
+        auto held = v->hold();
+        v->set(i, n);
+        return nullptr;
+    }
+};
+
+class VectorLength : public VectorProcedure {
+public:
+    VectorLength() : VectorProcedure("vector-length") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(1 == count);
+        const Vector* v = to_vector(args[0]);
+        auto held = v->hold();
+        return Value::Integer((int64_t)v->size());
+    }
+};
+
+class VectorSum : public VectorProcedure {
+public:
+    VectorSum() : VectorProcedure("vector-sum") {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(1 == count);
+        const Vector* v = to_vector(args[0]);
+        auto held = v->hold();
+        if (v->isDouble) {
+            return make_number(Number(kernels().sumDoubles(v->doubles.data(), v->size())));
+        }
+        int64_t total;
+        if (kernels().sumInts(v->ints.data(), v->size(), &total)) {
+            return make_number(Number(total));
+        }
+        Number sum(0);
+        for (int64_t i : v->ints) {
+            sum += Number(i);
+        }
+        return make_number(sum);
+    }
+};
+
+class VectorDot : public VectorProcedure {
+public:
+    VectorDot() : VectorProcedure("vector-dot") {}
+    Value apply(
+            const Value* args, int count) const override {
+        const Vector *u, *v;
+        auto held = check_pair(args, count, &u, &v);
+        if (!u->isDouble && !v->isDouble) {
+            // AVX2 has no 64-bit multiply, so integers are done one by one.
+            int64_t total = 0, product;
+            size_t i = 0;
+            for (; i < u->size(); ++i) {
+                if (!Number::Multiply(u->ints[i], v->ints[i], &product) ||
+                    !Number::Add(total, product, &total)) {
+                    break;
+                }
+            }
+            Number sum(total);
+            for (; i < u->size(); ++i) {
+                sum += Number(u->ints[i]) * Number(v->ints[i]);
+            }
+            return make_number(sum);
+        }
+        std::vector<double> a, b;
+        return make_number(Number(kernels().dotDoubles(
+                u->asDoubles(&a), v->asDoubles(&b), u->size())));
+    }
+};
+
+template <bool Max>
+class VectorExtreme : public VectorProcedure {
+public:
+    VectorExtreme(const char* n) : VectorProcedure(n) {}
+    Value apply(
+            const Value* args, int count) const override {
+        assert(1 == count);
+        const Vector* v = to_vector(args[0]);
+        auto held = v->hold();
+        assert(v->size() > 0);
+        if (v->isDouble) {
+            return make_number(Number(kernels().extremeDoubles[Max](v->doubles.data(), v->size())));
+        }
+        return make_number(Number(kernels().extremeInts[Max](v->ints.data(), v->size())));
+    }
+};
+
+// (vector-map+ u v) and the like, element by element.
+template <Arithmetic A>
+class VectorMap : public VectorProcedure {
+public:
+    VectorMap(const char* n) : VectorProcedure(n) {}
+    Value apply(
+            const Value* args, int count) const override {
+        const Vector *u, *v;
+        auto held = check_pair(args, count, &u, &v);
+        size_t size = u->size();
+        auto result = Value(new Vector);
+        auto out = static_cast<const Vector*>(result.get());
+        if (!u->isDouble && !v->isDouble) {
+            out->ints.resize(size);
+            if (this->ints(u->ints.data(), v->ints.data(), out->ints.data(), size)) {
+                return result;
+            }
+        }
+        out->isDouble = true;
+        out->ints = std::vector<int64_t>();
+        out->doubles.resize(size);
+        std::vector<double> a, b;
+        kernels().arithmeticDoubles[A](u->asDoubles(&a), v->asDoubles(&b),
+                                       out->doubles.data(), size);
+        return result;
+    }
+
+private:
+    static bool ints(const int64_t* x, const int64_t* y, int64_t* out, size_t n) {
+        if (A != kMultiply) {
+            return kernels().addInts[A == kSubtract](x, y, out, n);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (!Number::Multiply(x[i], y[i], &out[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// (vector-map< u v) and the like: a vector of 1 where the comparison holds
+// and 0 where it does not.
+template <Comparison C>
+class VectorCompare : public VectorProcedure {
+public:
+    VectorCompare(const char* n) : VectorProcedure(n) {}
+    Value apply(
+            const Value* args, int count) const override {
+        const Vector *u, *v;
+        auto held = check_pair(args, count, &u, &v);
+        auto result = new Vector;
+        result->ints.resize(u->size());
+        if (!u->isDouble && !v->isDouble) {
+            kernels().compareInts[C](u->ints.data(), v->ints.data(),
+                                     result->ints.data(), u->size());
+        } else {
+            std::vector<double> a, b;
+            kernels().compareDoubles[C](u->asDoubles(&a), v->asDoubles(&b),
+                                        result->ints.data(), u->size());
+        }
+        return Value(result);
+    }
+};
+
+}  // namespace
+
+bool dissemblance::vector_contents(
+        const Expression* e, bool* isDouble, const void** data, size_t* size) {
+    auto vector = dynamic_cast<const Vector*>(e);
+    if (!vector) {
+        return false;
+    }
+    *isDouble = vector->isDouble;
+    *data = vector->isDouble ? (const void*)vector->doubles.data()
+                             : (const void*)vector->ints.data();
+    *size = vector->size();
+    return true;
+}
+
+Value dissemblance::make_vector(bool isDouble, const void* data, size_t size) {
+    Vector* vector = new Vector;
+    vector->isDouble = isDouble;
+    if (isDouble) {
+        const double* doubles = static_cast<const double*>(data);
+        vector->doubles.assign(doubles, doubles + size);
+    } else {
+        const int64_t* ints = static_cast<const int64_t*>(data);
+        vector->ints.assign(ints, ints + size);
+    }
+    return Value(vector);
+}
+
+void dissemblance::add_vector_procedures(Env* env) {
+    auto& map = env->map;
+    map[intern("make-vector")] = Value(new MakeVector);
+    map[intern("vector")] = Value(new VectorOf);
+    map[intern("vector-ref")] = Value(new VectorRef);
+    map[intern("vector-set!")] = Value(new VectorSet);
+    map[intern("vector-length")] = Value(new VectorLength);
+    map[intern("vector-sum")] = Value(new VectorSum);
+    map[intern("vector-dot")] = Value(new VectorDot);
+    map[intern("vector-min")] = Value(new VectorExtreme<false>("vector-min"));
+    map[intern("vector-max")] = Value(new VectorExtreme<true>("vector-max"));
+    map[intern("vector-map+")] = Value(new VectorMap<kAdd>("vector-map+"));
+    map[intern("vector-map-")] = Value(new VectorMap<kSubtract>("vector-map-"));
+    map[intern("vector-map*")] = Value(new VectorMap<kMultiply>("vector-map*"));
+    map[intern("vector-map<")] = Value(new VectorCompare<kLess>("vector-map<"));
+    map[intern("vector-map=")] = Value(new VectorCompare<kEqual>("vector-map="));
+    map[intern("vector-map>")] = Value(new VectorCompare<kGreater>("vector-map>"));
+}
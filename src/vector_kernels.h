@@ -0,0 +1,201 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// The bulk operations on numeric vectors, written once over a set of SIMD
+// operations `Isa`.  vector.cpp includes this once per instruction set, in a
+// namespace that defines `Isa` and under that instruction set's target
+// pragma, so there is deliberately no include guard.
+//
+// Each kernel does whole registers of Isa::kLanes elements, then the rest one
+// at a time.  Sums and products of doubles are added up by lane, so they are
+// rounded differently from a loop from first to last.
+
+// Sets *total and returns true, or returns false if the sum overflows.
+inline bool sum_ints(const int64_t* x, size_t n, int64_t* total) {
+    typename Isa::I acc = Isa::zeroi();
+    typename Isa::I overflow = Isa::zeroi();
+    size_t i = 0;
+    for (; i + Isa::kLanes <= n; i += Isa::kLanes) {
+        typename Isa::I v = Isa::loadi(x + i);
+        typename Isa::I sum = Isa::addi(acc, v);
+        // Overflowed where both operands' signs differ from the sum's.
+        overflow = Isa::ori(overflow, Isa::andi(Isa::xori(acc, sum), Isa::xori(v, sum)));
+        acc = sum;
+    }
+    if (Isa::negative(overflow)) {
+        return false;
+    }
+    int64_t lanes[Isa::kLanes];
+    Isa::storei(lanes, acc);
+    int64_t result = 0;
+    for (size_t k = 0; k < Isa::kLanes; ++k) {
+        if (!Number::Add(result, lanes[k], &result)) {
+            return false;
+        }
+    }
+    for (; i < n; ++i) {
+        if (!Number::Add(result, x[i], &result)) {
+            return false;
+        }
+    }
+    *total = result;
+    return true;
+}
+
+// Returns false if any difference or sum overflows.
+template <bool Subtract>
+bool add_ints(const int64_t* x, const int64_t* y, int64_t* out, size_t n) {
+    typename Isa::I overflow = Isa::zeroi();
+    size_t i = 0;
+    for (; i + Isa::kLanes <= n; i += Isa::kLanes) {
+        typename Isa::I a = Isa::loadi(x + i);
+        typename Isa::I b = Isa::loadi(y + i);
+        typename Isa::I r = Subtract ? Isa::subi(a, b) : Isa::addi(a, b);
+        overflow = Isa::ori(overflow, Subtract
+                ? Isa::andi(Isa::xori(a, b), Isa::xori(a, r))
+                : Isa::andi(Isa::xori(a, r), Isa::xori(b, r)));
+        Isa::storei(out + i, r);
+    }
+    if (Isa::negative(overflow)) {
+        return false;
+    }
+    for (; i < n; ++i) {
+        if (!(Subtract ? Number::Subtract(x[i], y[i], &out[i])
+                       : Number::Add(x[i], y[i], &out[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <bool Max>
+int64_t extreme_ints(const int64_t* x, size_t n) {
+    size_t i = 0;
+    int64_t result = x[0];
+    if (n >= Isa::kLanes) {
+        typename Isa::I acc = Isa::loadi(x);
+        for (i = Isa::kLanes; i + Isa::kLanes <= n; i += Isa::kLanes) {
+            typename Isa::I v = Isa::loadi(x + i);
+            acc = Max ? Isa::select(Isa::gti(v, acc), v, acc)
+                      : Isa::select(Isa::gti(acc, v), v, acc);
+        }
+        int64_t lanes[Isa::kLanes];
+        Isa::storei(lanes, acc);
+        result = lanes[0];
+        for (size_t k = 1; k < Isa::kLanes; ++k) {
+            result = Max ? std::max(result, lanes[k]) : std::min(result, lanes[k]);
+        }
+    }
+    for (; i < n; ++i) {
+        result = Max ? std::max(result, x[i]) : std::min(result, x[i]);
+    }
+    return result;
+}
+
+// Sets each of `out` to 1 or 0.
+template <Comparison C>
+void compare_ints(const int64_t* x, const int64_t* y, int64_t* out, size_t n) {
+    size_t i = 0;
+    for (; i + Isa::kLanes <= n; i += Isa::kLanes) {
+        typename Isa::I a = Isa::loadi(x + i);
+        typename Isa::I b = Isa::loadi(y + i);
+        typename Isa::I mask = C == kLess ? Isa::gti(b, a)
+                             : C == kEqual ? Isa::eqi(a, b)
+                             : Isa::gti(a, b);
+        Isa::storei(out + i, Isa::one(mask));
+    }
+    for (; i < n; ++i) {
+        out[i] = C == kLess ? x[i] < y[i] : C == kEqual ? x[i] == y[i] : x[i] > y[i];
+    }
+}
+
+inline double sum_doubles(const double* x, size_t n) {
+    typename Isa::D acc = Isa::zero();
+    size_t i = 0;
+    for (; i + Isa::kLanes <= n; i += Isa::kLanes) {
+        acc = Isa::add(acc, Isa::load(x + i));
+    }
+    double result = Isa::sum(acc);
+    for (; i < n; ++i) {
+        result += x[i];
+    }
+    return result;
+}
+
+inline double dot_doubles(const double* x, const double* y, size_t n) {
+    typename Isa::D acc = Isa::zero();
+    size_t i = 0;
+    for (; i + Isa::kLanes <= n; i += Isa::kLanes) {
+        acc = Isa::add(acc, Isa::mul(Isa::load(x + i), Isa::load(y + i)));
+    }
+    double result = Isa::sum(acc);
+    for (; i < n; ++i) {
+        result += x[i] * y[i];
+    }
+    return result;
+}
+
+template <bool Max>
+double extreme_doubles(const double* x, size_t n) {
+    size_t i = 0;
+    double result = x[0];
+    if (n >= Isa::kLanes) {
+        typename Isa::D acc = Isa::load(x);
+        for (i = Isa::kLanes; i + Isa::kLanes <= n; i += Isa::kLanes) {
+            acc = Max ? Isa::max(acc, Isa::load(x + i)) : Isa::min(acc, Isa::load(x + i));
+        }
+        double lanes[Isa::kLanes];
+        Isa::store(lanes, acc);
+        result = lanes[0];
+        for (size_t k = 1; k < Isa::kLanes; ++k) {
+            result = Max ? std::max(result, lanes[k]) : std::min(result, lanes[k]);
+        }
+    }
+    for (; i < n; ++i) {
+        result = Max ? std::max(result, x[i]) : std::min(result, x[i]);
+    }
+    return result;
+}
+
+template <Arithmetic A>
+void arithmetic_doubles(const double* x, const double* y, double* out, size_t n) {
+    size_t i = 0;
+    for (; i + Isa::kLanes <= n; i += Isa::kLanes) {
+        typename Isa::D a = Isa::load(x + i);
+        typename Isa::D b = Isa::load(y + i);
+        Isa::store(out + i, A == kAdd ? Isa::add(a, b)
+                          : A == kSubtract ? Isa::sub(a, b)
+                          : Isa::mul(a, b));
+    }
+    for (; i < n; ++i) {
+        out[i] = A == kAdd ? x[i] + y[i] : A == kSubtract ? x[i] - y[i] : x[i] * y[i];
+    }
+}
+
+template <Comparison C>
+void compare_doubles(const double* x, const double* y, int64_t* out, size_t n) {
+    size_t i = 0;
+    for (; i + Isa::kLanes <= n; i += Isa::kLanes) {
+        typename Isa::D a = Isa::load(x + i);
+        typename Isa::D b = Isa::load(y + i);
+        Isa::storei(out + i, C == kLess ? Isa::lt(a, b)
+                           : C == kEqual ? Isa::eq(a, b)
+                           : Isa::lt(b, a));
+    }
+    for (; i < n; ++i) {
+        out[i] = C == kLess ? x[i] < y[i] : C == kEqual ? x[i] == y[i] : x[i] > y[i];
+    }
+}
+
+const Kernels kKernels = {
+    Isa::kName,
+    sum_ints,
+    {add_ints<false>, add_ints<true>},
+    {extreme_ints<false>, extreme_ints<true>},
+    {compare_ints<kLess>, compare_ints<kEqual>, compare_ints<kGreater>},
+    sum_doubles,
+    dot_doubles,
+    {extreme_doubles<false>, extreme_doubles<true>},
+    {arithmetic_doubles<kAdd>, arithmetic_doubles<kSubtract>, arithmetic_doubles<kMultiply>},
+    {compare_doubles<kLess>, compare_doubles<kEqual>, compare_doubles<kGreater>},
+};
@@ -0,0 +1,401 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+// A compiler from expressions to bytecode, and a stack machine to run it.
+//
+// Lambda bodies are compiled after variable resolution, so local variables
+// live in the same frames the tree-walking evaluator uses, and a closure made
+// by either engine can be called by the other.
+
+#include "dissemblance.h"
+#include "expression.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <mutex>
+
+using namespace dissemblance;
+
+namespace {
+
+enum Op {
+    kConst,        // index:       push constants[index]
+    kLocal,        // depth slot:  push a local variable
+    kGlobal,       // index:       push the binding the GlobalRef constants[index] names
+    kSetLocal,     // depth slot:  pop into a local variable, push ()
+    kDefineLocal,  // depth slot:  the same, naming a lambda for the variable
+    kSetGlobal,    // index:       pop into the binding of symbol constants[index], push ()
+    kDefine,       // index:       pop into a new binding, push ()
+    kPop,          //              discard the top of the stack
+    kJump,         // target:      continue at code[target]
+    kJumpIfNot,    // target:      pop, and continue at code[target] if it was ()
+    kClosure,      // index:       push a closure of lambdas[index]
+    kCall,         // count:       call the procedure below the top `count` values
+    kTailCall,     // count:       the same, in place of the current call
+    kReturn,       //              return the top of the stack
+};
+
+}  // namespace
+
+struct dissemblance::Program {
+    std::vector<int> code;
+    std::vector<Value> constants;
+    std::vector<std::shared_ptr<const LambdaCode> > lambdas;
+};
+
+namespace {
+
+std::shared_ptr<const Program> compile_lambda(const Value& body, Env*);
+
+std::mutex gCompileLock;
+
+// The lambda's program, compiled now if it is not yet.  Two threads may both
+// compile it; the first to finish keeps its program, and the other's is
+// dropped.
+const Program* compiled(const LambdaCode& code, Env* env) {
+    int stale = code.stale();
+    const Program* program = code.program[stale].load(std::memory_order_acquire);
+    if (!program) {
+        std::shared_ptr<const Program> mine =
+                compile_lambda(stale ? code.unfolded : code.body, env);
+        std::lock_guard<std::mutex> lock(gCompileLock);
+        if (!code.compiled[stale]) {
+            code.compiled[stale] = std::move(mine);
+            code.program[stale].store(code.compiled[stale].get(), std::memory_order_release);
+        }
+        program = code.compiled[stale].get();
+    }
+    return program;
+}
+
+class Compiler {
+    Program* program;
+    Env* env;  // where special forms are looked up.
+
+    int constant(const Value& value) {
+        program->constants.push_back(value);
+        return (int)program->constants.size() - 1;
+    }
+    void emit(int word) { program->code.push_back(word); }
+    void emit(Op op, int operand) {
+        this->emit(op);
+        this->emit(operand);
+    }
+    // Emits a jump, and returns where its target goes.
+    int jump(Op op) {
+        this->emit(op, -1);
+        return (int)program->code.size() - 1;
+    }
+    void land(int jump) { program->code[jump] = (int)program->code.size(); }
+
+    Procedure::Form form(const Value& head) const {
+        Value value = head;
+        const Symbol* symbol = dcastSymbol(head);
+        if (const GlobalRef* ref = dcastGlobalRef(head)) {
+            symbol = ref->symbol;
+        }
+        if (symbol) {
+            Value* ptr = find(env, symbol);
+            value = ptr ? *ptr : nullptr;
+        }
+        const Procedure* proc = dcastProcedure(value);
+        return proc ? proc->form() : Procedure::Application;
+    }
+
+    void closure(const std::shared_ptr<const LambdaCode>& code) {
+        compiled(*code, env);
+        program->lambdas.push_back(code);
+        this->emit(kClosure, (int)program->lambdas.size() - 1);
+    }
+
+public:
+    Compiler(Program* p, Env* e) : program(p), env(e) {}
+
+    // `tail` is true when the value is returned straight after.
+    void compile(const Value& expr, bool tail) {
+        if (const Symbol* symbol = dcastSymbol(expr)) {
+            this->emit(kGlobal, this->constant(Value(new GlobalRef(symbol))));
+            return;
+        }
+        if (dcastGlobalRef(expr)) {
+            this->emit(kGlobal, this->constant(expr));
+            return;
+        }
+        if (const LocalRef* ref = dcastLocalRef(expr)) {
+            this->emit(kLocal);
+            this->emit(ref->depth);
+            this->emit(ref->slot);
+            return;
+        }
+        const Cons* cons = dcastCons(expr);
+        if (!cons) {
+            this->emit(kConst, this->constant(expr));  // e. g. number;
+            return;
+        }
+        const Value& operands = cons->right;
+        switch (Procedure::Form form = this->form(cons->left)) {
+            case Procedure::QuoteForm:
+                assert(1 == length(operands));
+                this->emit(kConst, this->constant(get_item(operands, 0)));
+                return;
+            case Procedure::IfForm: {
+                //        0     1    2
+                // (if . (cond then else))
+                assert(3 == length(operands));
+                this->compile(get_item(operands, 0), false);
+                int otherwise = this->jump(kJumpIfNot);
+                this->compile(get_item(operands, 1), tail);
+                int done = this->jump(kJump);
+                this->land(otherwise);
+                this->compile(get_item(operands, 2), tail);
+                this->land(done);
+                return;
+            }
+            case Procedure::BeginForm:
+                this->sequence(operands, tail);
+                return;
+            case Procedure::LambdaForm: {
+                auto resolved = dynamic_cast<const MakeClosure*>(cons->left.get());
+                this->closure(resolved ? resolved->code : resolve_lambda(operands, env));
+                return;
+            }
+            case Procedure::DefineForm:
+            case Procedure::SetForm: {
+                //          0        1
+                // (set! . (variable (+ b c d))
+                assert(2 == length(operands));
+                const auto& variable = get_item(operands, 0);
+                this->compile(get_item(operands, 1), false);
+                if (const LocalRef* ref = dcastLocalRef(variable)) {
+                    this->emit(form == Procedure::DefineForm ? kDefineLocal : kSetLocal);
+                    this->emit(ref->depth);
+                    this->emit(ref->slot);
+                } else if (form == Procedure::DefineForm) {
+                    this->emit(kDefine, this->constant(Value(get_symbol(variable))));
+                } else {
+                    this->emit(kSetGlobal, this->constant(Value(get_symbol(variable))));
+                }
+                return;
+            }
+            case Procedure::Application:
+            default: {
+                this->compile(cons->left, false);
+                int count = 0;
+                for (const Cons* c = dcastCons(operands); c; c = dcastCons(c->right)) {
+                    this->compile(c->left, false);
+                    ++count;
+                }
+                this->emit(tail ? kTailCall : kCall, count);
+                return;
+            }
+        }
+    }
+
+    // Compiles a list of forms as `begin` does.
+    void sequence(const Value& forms, bool tail) {
+        const Cons* cons = dcastCons(forms);
+        assert(cons); // takes list
+        while (const Cons* next = dcastCons(cons->right)) {
+            this->compile(cons->left, false);
+            this->emit(kPop);
+            cons = next;
+        }
+        this->compile(cons->left, tail);
+    }
+
+    void finish() { this->emit(kReturn); }
+};
+
+std::shared_ptr<const Program> compile_lambda(const Value& body, Env* env) {
+    auto program = std::make_shared<Program>();
+    Compiler compiler(program.get(), env);
+    compiler.sequence(body, true);
+    compiler.finish();
+    return program;
+}
+
+// A caller waiting for a call to return.
+struct Call {
+    const Program* program;
+    const int* pc;
+    Ref<Env> env;
+    size_t base;  // the caller's part of the stack starts here.
+    size_t profileDepth;  // the profiler's, before the caller's call began.
+};
+
+Value* global(Env* env, const Value& constant) {
+    const GlobalRef* ref = static_cast<const GlobalRef*>(constant.get());
+    Value* ptr = find(env, ref);
+    if (!ptr) {
+        std::cerr << "missing symbol: '" << ref->symbol->name << "'.  :(\n";
+    }
+    assert(ptr);
+    return ptr;
+}
+
+Value run(const Program* program, Ref<Env> env) {
+    std::vector<Value> stack;
+    std::vector<Call> calls;
+    const int* pc = program->code.data();
+    size_t base = 0;
+    size_t profileDepth = gProfiling ? profile_depth() : 0;
+    while (true) {
+        int op = *pc++;
+        switch (op) {
+            case kConst:
+                stack.push_back(program->constants[*pc++]);
+                break;
+            case kLocal:
+                stack.push_back(find(env.get(), pc[0], pc[1]));
+                pc += 2;
+                break;
+            case kGlobal:
+                stack.push_back(load_global(global(env.get(), program->constants[*pc++])));
+                break;
+            case kSetLocal:
+            case kDefineLocal: {
+                Value& variable = find(env.get(), pc[0], pc[1]);
+                variable = std::move(stack.back());
+                stack.back() = nullptr;
+                if (op == kDefineLocal && dcastProcedure(variable)) {
+                    Env* frame = env.get();
+                    for (int depth = pc[0]; depth > 0; --depth) {
+                        frame = frame->outer.get();
+                    }
+                    name_lambda(variable, frame->code->variables[pc[1]]);
+                }
+                pc += 2;
+                break;
+            }
+            case kSetGlobal: {
+                // Not cached, since whether the binding may be set depends on
+                // which environment it is in.
+                Value* ptr = assign(env.get(), dcastSymbol(program->constants[*pc++]));
+                assert(ptr);
+                store_global(ptr, std::move(stack.back()));
+                stack.back() = nullptr;
+                break;
+            }
+            case kDefine: {
+                const Symbol* symbol = dcastSymbol(program->constants[*pc++]);
+                Value& variable = define(env.get(), symbol);
+                name_lambda(stack.back(), symbol);
+                store_global(&variable, std::move(stack.back()));
+                stack.back() = nullptr;
+                break;
+            }
+            case kPop:
+                stack.pop_back();
+                break;
+            case kJump:
+                pc = program->code.data() + *pc;
+                break;
+            case kJumpIfNot:
+                if (stack.back()) {
+                    ++pc;
+                } else {
+                    pc = program->code.data() + *pc;
+                }
+                stack.pop_back();
+                break;
+            case kClosure:
+                stack.push_back(Value(new LambdaProc(program->lambdas[*pc++], env)));
+                break;
+            case kCall:
+            case kTailCall: {
+                safe_point();
+                int count = *pc++;
+                size_t callee = stack.size() - count - 1;
+                Value function = std::move(stack[callee]);
+                const Procedure* proc = dcastProcedure(function);
+                if (!proc) {
+                    Expression::Serialize(function, &std::cerr);
+                    std::cerr << '\n';
+                    assert(false);
+                }
+                if (const LambdaProc* lambda = proc->asLambdaProc()) {
+                    const LambdaCode& code = *lambda->code;
+                    assert(count == code.arity);
+                    auto frame = Ref<Env>(new Env(lambda->environment));
+                    frame->code = lambda->code;
+                    frame->slots.resize(code.variables.size());
+                    std::move(stack.begin() + callee + 1, stack.end(), frame->slots.begin());
+                    if (op == kTailCall) {
+                        stack.resize(base);
+                        if (gProfiling) {
+                            profile_exit_to(profileDepth);
+                        }
+                    } else {
+                        stack.resize(callee);
+                        calls.push_back(Call{program, pc, std::move(env), base, profileDepth});
+                        base = callee;
+                        profileDepth = gProfiling ? profile_depth() : 0;
+                    }
+                    if (gProfiling) {
+                        profile_enter(lambda);
+                    }
+                    program = compiled(code, lambda->environment.get());
+                    pc = program->code.data();
+                    env = std::move(frame);
+                    break;
+                }
+                Value value;
+                if (gProfiling) {
+                    size_t depth = profile_depth();
+                    profile_enter(proc);
+                    value = proc->apply(stack.data() + callee + 1, count);
+                    profile_exit_to(depth);
+                } else {
+                    value = proc->apply(stack.data() + callee + 1, count);
+                }
+                stack.resize(callee);
+                stack.push_back(std::move(value));
+                if (op == kCall) {
+                    break;
+                }
+                // A builtin called in tail position: return its value.
+                [[fallthrough]];
+            }
+            case kReturn: {
+                auto value = std::move(stack.back());
+                stack.resize(base);
+                if (gProfiling) {
+                    profile_exit_to(profileDepth);
+                }
+                if (calls.empty()) {
+                    return value;
+                }
+                Call& caller = calls.back();
+                program = caller.program;
+                pc = caller.pc;
+                env = std::move(caller.env);
+                base = caller.base;
+                profileDepth = caller.profileDepth;
+                calls.pop_back();
+                stack.push_back(std::move(value));
+                break;
+            }
+            default:
+                assert(false);
+        }
+    }
+}
+
+}  // namespace
+
+std::shared_ptr<const Program> dissemblance::Compile(
+        const Value& expr,
+        Environment& env) {
+    auto program = std::make_shared<Program>();
+    Compiler compiler(program.get(), env.impl.get());
+    compiler.compile(expr, true);
+    compiler.finish();
+    return program;
+}
+
+Value dissemblance::Run(
+        const std::shared_ptr<const Program>& program,
+        Environment& env) {
+    return run(program.get(), env.impl);
+}
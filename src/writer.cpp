@@ -0,0 +1,90 @@
+// Copyright 2018 Google LLC.
+// Use of this source code is governed by a BSD-style license that can be found in the LICENSE file.
+
+#include "dissemblance.h"
+#include "expression.h"
+
+#include <sstream>
+
+using namespace dissemblance;
+
+namespace {
+const size_t kBufferSize = 1 << 16;
+}
+
+dissemblance::Writer::Writer(std::ostream* o) : out(o), buffer(kBufferSize) {}
+
+dissemblance::Writer::~Writer() { this->flush(); }
+
+void dissemblance::Writer::flush() {
+    if (used > 0) {
+        out->write(buffer.data(), used);
+        used = 0;
+    }
+}
+
+void dissemblance::Writer::write(std::string_view text) {
+    if (text.size() > buffer.size() - used) {
+        this->flush();
+        if (text.size() > buffer.size()) {
+            out->write(text.data(), text.size());
+            return;
+        }
+    }
+    memcpy(buffer.data() + used, text.data(), text.size());
+    used += text.size();
+}
+
+// Writes anything but a list.
+void dissemblance::Writer::atom(const Value& value) {
+    if (!value) {
+        this->write("()");
+    } else if (is_number(value)) {
+        if (buffer.size() - used < Number::kMaxChars) {
+            this->flush();
+        }
+        char* start = buffer.data() + used;
+        used += to_number(value).toChars(start, start + Number::kMaxChars) - start;
+    } else if (const Symbol* symbol = dcastSymbol(value)) {
+        this->write(symbol->name);
+    } else {
+        std::ostringstream text;
+        value.get()->serialize(&text);
+        this->write(text.str());
+    }
+}
+
+void dissemblance::Writer::write(const Value& value) {
+    // Each list being written is represented by the cell whose car was
+    // written last.
+    size_t outer = lists.size();
+    const Value* next = &value;
+    while (true) {
+        if (const Cons* cons = dcastCons(*next)) {
+            this->write('(');
+            lists.push_back(cons);
+            next = &cons->left;
+            continue;
+        }
+        this->atom(*next);
+        // Close every list this finished, and move on to the next element.
+        while (true) {
+            if (lists.size() == outer) {
+                return;
+            }
+            const Cons* cons = lists.back();
+            if (const Cons* rest = dcastCons(cons->right)) {
+                this->write(' ');
+                lists.back() = rest;
+                next = &rest->left;
+                break;
+            }
+            if (cons->right) {
+                this->write(" . ");
+                this->atom(cons->right);
+            }
+            this->write(')');
+            lists.pop_back();
+        }
+    }
+}
@@ -1,13 +1,27 @@
 #!/bin/sh
 
 GOOD=1
+PROGRAM="$(mktemp)"
+# Tests given a program through a pipe run in a subshell, so they note a
+# failure here rather than in GOOD.
+FAILED="$PROGRAM.failed"
+trap 'rm -f "$PROGRAM" "$FAILED"' EXIT
 test() {
     Q="$(cat)"
     A="$1"
-    X="$(echo "$Q" | bin/dissemblance | tail -n 1)"
+    for ENGINE in '' --vm '--vm --hash-cons'; do
+        X="$(echo "$Q" | bin/dissemblance $ENGINE | tail -n 1)"
+        if ! [ "$A" = "$X" ] ; then
+            echo "\"$Q\" $ENGINE => \"$X\", not \"$A\""
+            : > "$FAILED"
+        fi
+    done
+    # A file is parsed where it is mapped, rather than read from a stream.
+    printf '%s' "$Q" > "$PROGRAM"
+    X="$(bin/dissemblance --batch "$PROGRAM" | tail -n 1)"
     if ! [ "$A" = "$X" ] ; then
-        echo "\"$Q\" => \"$X\", not \"$A\""
-        GOOD=''
+        echo "\"$Q\" from a file => \"$X\", not \"$A\""
+        : > "$FAILED"
     fi
 }
 
@@ -16,6 +30,8 @@ echo '(if () (quote A) (quote B))' | test 'B'
 echo "(if 'T 'A 'B)" | test "A"
 echo "(if () 'A 'B)" | test "B"
 echo '(define x 3) (+ x x)' | test '6'
+echo '(define x 3)(+ x x)' | test '6'
+echo "(define x 3)'x" | test 'x'
 echo '(+)' | test '0'
 echo '(+ 99)' | test '99'
 echo '(* 99)' | test '99'
@@ -23,6 +39,8 @@ echo '(* 99 10)' | test '990'
 echo '(* 99.5 10)' | test '995'
 echo '(+ 99 1.0e3)' | test '1099'
 echo '(+ 3 9 1)' | test '13'
+echo '(list 1 2 3 4 (+ 1 2 3 4 5 6) 6)' | test '(1 2 3 4 21 6)'
+echo '((lambda (a b c d e f) (list f e d c b a)) 1 2 3 4 5 6)' | test '(6 5 4 3 2 1)'
 echo '(- 1)' | test '-1'
 echo '(- 3 1)' | test '2'
 echo '((lambda (x) (+ x x)) 5)' | test '10'
@@ -35,6 +53,12 @@ echo '(< 1 2)' | test '1'
 echo '(> 1 2)' | test '()'
 echo '(> 1 2)' | test '()'
 echo '(< 1 2)' | test '1'
+echo '(* 1000000000 1000000)' | test '1000000000000000'
+echo '(- (* 1000000000 1000000 1000) 1)' | test '999999999999999999'
+echo '(= 140737488355328 (+ 140737488355327 1))' | test '1'
+echo '(- 0 140737488355329)' | test '-140737488355329'
+echo '(/ 1 2.0)' | test '0.5'
+echo '(- 2.5)' | test '-2.5'
 
 #RECURSION!
 test '120' <<EOF
@@ -88,8 +112,403 @@ test 13 << EOF
 (fib 6)
 EOF
 
-if [ "$GOOD" ]; then
+# Lexical scope.
+echo '(define add (lambda (x) (lambda (y) (+ x y)))) ((add 3) 4)' | test '7'
+echo '(define x 1) (define f (lambda (x) (set! x (+ x 1)) x)) (f 5)' | test '6'
+echo '(define x 1) (define f (lambda (x) (set! x (+ x 1)) x)) (f 5) x' | test '1'
+echo '(define x 1) (define f (lambda () (set! x 7))) (f) x' | test '7'
+echo '(define f (lambda (if) (+ if 1))) (f 1)' | test '2'
+echo "(define f (lambda (x) '(x y))) (f 1)" | test '(x y)'
+echo '(define f (lambda (x) (lambda (y) (+ x y)))) (f 1)' | test '(lambda (y) (+ x y))'
+
+# Vectors, with each set of kernels, long enough to fill a few registers.
+echo '(define v (make-vector 3 1)) (vector-set! v 1 2.5) v' | test '#(1 2.5 1)'
+for SIMD in avx2 sse4.2 scalar; do
+    export DISSEMBLANCE_SIMD=$SIMD
+    echo '(vector-sum (vector 1 2 3 4 5 6 7 8 9))' | test '45'
+    echo '(vector-sum (vector 9223372036854775807 1 0 0 0))' | test '9.22337e+18'
+    echo '(vector-dot (vector 1 2 3 4 5) (vector 2 2 2 2 0.5))' | test '22.5'
+    echo '(vector-max (vector 5 (- 3) 12 8 1 99 (- 100)))' | test '99'
+    echo '(vector-min (vector 5 (- 3) 12 8 1 99 (- 100)))' | test '-100'
+    echo '(vector-min (vector 5 3.5 12 8 1 99 2))' | test '1'
+    echo '(vector-map+ (vector 1 2 3 4 5) (vector 10 20 30 40 50))' | test '#(11 22 33 44 55)'
+    echo '(vector-map- (vector 1 2 3 4 5) (vector 1 1 1 1 1.5))' | test '#(0 1 2 3 3.5)'
+    echo '(vector-map+ (vector 9223372036854775807 1 2 3 4) (make-vector 5 1))' |
+        test '#(9.22337e+18 2 3 4 5)'
+    echo '(vector-map< (vector 1 5 3 7 2) (vector 2 4 3 8 1))' | test '#(1 0 0 1 0)'
+    echo '(vector-map= (vector 1 5 3 7 2.0) (vector 2 4 3 8 2))' | test '#(0 0 1 0 1)'
+    echo '(vector-map> (vector 1 5 3 7 2) (vector 2 4 3 8 1))' | test '#(0 1 0 0 1)'
+done
+unset DISSEMBLANCE_SIMD
+
+# Futures and pmap, on one thread and on several.
+echo '(map (lambda (x) (* x x)) (list 1 2 3))' | test '(1 4 9)'
+for THREADS in 1 4; do
+    export DISSEMBLANCE_THREADS=$THREADS
+    echo '(touch (future (lambda () (+ 1 2))))' | test '3'
+    echo '(touch 7)' | test '7'
+    echo '(define x 5) (touch (future (lambda () (touch (future (lambda () (* x x)))))))' |
+        test '25'
+    echo '(pmap (lambda (x) (* x x)) (list 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17))' |
+        test '(1 4 9 16 25 36 49 64 81 100 121 144 169 196 225 256 289)'
+    echo '(pmap car (quote ()))' | test '()'
+    echo '(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+          (define fs (pmap (lambda (n) (future (lambda () (fib n)))) (list 10 15 20)))
+          (map touch fs)' | test '(55 610 6765)'
+done
+
+# Programs racing on shared values, run under ThreadSanitizer too if `make
+# tsan` built it, as it must have if DISSEMBLANCE_TSAN is set.
+test_threads() {
+    Q="$(cat)"
+    A="$1"
+    for DISSEMBLANCE in bin/dissemblance bin/tsan/dissemblance; do
+        if ! [ -x "$DISSEMBLANCE" ]; then
+            if [ "$DISSEMBLANCE_TSAN" ]; then
+                echo "$DISSEMBLANCE is missing"
+                : > "$FAILED"
+            fi
+            continue
+        fi
+        for ENGINE in '' --vm; do
+            X="$(echo "$Q" | TSAN_OPTIONS=halt_on_error=1 "$DISSEMBLANCE" $ENGINE 2>&1 | tail -n 1)"
+            if ! [ "$A" = "$X" ]; then
+                echo "\"$Q\" $DISSEMBLANCE $ENGINE => \"$X\", not \"$A\""
+                : > "$FAILED"
+            fi
+        done
+    done
+}
+# Two threads setting one global at once, and each reading it, leave it whole.
+echo "(define x (list 0))
+      (define bump (lambda (n) (if (= n 0) 'done (begin (set! x (list n (car x))) (bump (- n 1))))))
+      (define other (future (lambda () (bump 20000))))
+      (bump 20000) (touch other) (car x)" | test_threads '1'
+# One thread storing a double in vectors of integers as another sums them.
+echo "(define v (make-vector 100 1))
+      (define sums (lambda (n) (if (= n 0) 'done (begin (vector-sum v) (sums (- n 1))))))
+      (define fill (lambda (n) (if (= n 0) 'done
+                                   (begin (set! v (make-vector 100 1)) (vector-set! v 0 0.5)
+                                          (fill (- n 1))))))
+      (define other (future (lambda () (sums 20000))))
+      (fill 20000) (touch other) (vector-sum v)" | test_threads '99.5'
+unset DISSEMBLANCE_THREADS
+
+# Printing a lambda shows its body as simplified when it was created.
+echo '(lambda () (* 60 60 24))' | test '(lambda () 86400)'
+echo "(lambda (x) (if (< 1 2) (begin 1 (begin x 'y)) x))" | test '(lambda (x) x (quote y))'
+echo '(lambda (x) (/ x 0) (/ 1 0))' | test '(lambda (x) (/ x 0) (/ 1 0))'
+echo '(define f (lambda (+) (+ 1 2))) (f -)' | test '-1'
+echo '(define f (lambda () (+ 1 2))) (f) (set! + -) (f)' | test '-1'
+echo "(define f (lambda () (if (< 1 2) 'a 'b))) (f) (set! < >) (f)" | test 'b'
+
+# A lambda sees globals set or defined after it was last called.
+echo '(define f (lambda () (g))) (define g (lambda () 1)) (f) (set! g (lambda () 2)) (f)' | test '2'
+echo '(define get (lambda () x)) (define x 5) (get)' | test '5'
+for ENGINE in '' --vm; do
+    # A global being defined is not yet bound while its value is evaluated.
+    X="$( (echo '(define x x)' | bin/dissemblance $ENGINE) 2>&1 | head -n 1)"
+    if ! [ "$X" = "missing symbol: 'x'.  :(" ]; then
+        echo "(define x x) $ENGINE => \"$X\""
+        GOOD=''
+    fi
+done
+
+# Until its define is reached, a name defined in a body means what it did outside.
+echo '(define y 1) (define g (lambda () (define y (+ y 1)) y)) (g)' | test '2'
+echo '(define y 1) ((lambda () (define z y) (define y 2) (list z y)))' | test '(1 2)'
+
+test '()' << EOF
+(define even
+  (lambda (n)
+    (define even? (lambda (n) (if (= n 0) 1 (odd? (- n 1)))))
+    (define odd? (lambda (n) (if (= n 0) () (even? (- n 1)))))
+    (even? n)))
+(even 7)
+EOF
+
+test 3 << EOF
+(define counter
+  (lambda ()
+    (define n 0)
+    (lambda () (set! n (+ n 1)) n)))
+(define c (counter))
+(c)
+(c)
+(c)
+EOF
+
+# Tail calls run in constant stack.
+test 500000500000 << EOF
+(define sum
+  (lambda (i acc)
+    (if (= i 0)
+        acc
+        (sum (- i 1) (+ acc i)))))
+(sum 1000000 0)
+EOF
+
+test done << EOF
+(define count-down
+  (lambda (i)
+    (begin
+      (define next (- i 1))
+      (if (< next 0)
+          'done
+          (count-down next)))))
+(count-down 1000000)
+EOF
+
+test 1000000 << EOF
+(define even?
+  (lambda (n) (if (= n 0) 1 (odd? (- n 1)))))
+(define odd?
+  (lambda (n) (if (= n 0) () (even? (- n 1)))))
+(define n 0)
+(define loop
+  (lambda ()
+    (set! n (+ n 1))
+    (if (< n 1000000) (loop) n)))
+(if (even? 1000000) (loop) 'odd)
+EOF
+
+# Each call of f leaves a frame and a closure referring to each other.
+test 0 << EOF
+(define f
+  (lambda (n)
+    (define g (lambda (k) (if (= k 0) 0 (g (- k 1)))))
+    (g n)))
+(define loop
+  (lambda (i) (if (= i 0) 0 (begin (f 3) (loop (- i 1))))))
+(loop 50000)
+EOF
+
+# Neither parsing nor freeing a list recurses per element or per level.
+(echo '(car (cdr (quote ('; seq 1000000; echo '))))') | test 2
+(echo '(cdr (quote ('
+ awk 'BEGIN { for (i = 0; i < 100000; i++) printf "(" }'
+ awk 'BEGIN { for (i = 0; i < 100000; i++) printf ")" }'
+ echo ')))') | test '()'
+
+# Nor does printing one.
+DEEP="$(awk 'BEGIN { for (i = 0; i < 100000; i++) printf "(" }
+             END { for (i = 0; i < 100000; i++) printf ")" }' < /dev/null)"
+echo "(quote $DEEP)" | test "$DEEP"
+echo "'(1 (2 (3 . 4)) . 5)" | test '(1 (2 (3 . 4)) . 5)'
+echo '(/ 1.0 3)' | test '0.333333'
+
+# Integer arithmetic that overflows int64_t gives a float.
+echo '(+ 9223372036854775807 1)' | test '9.22337e+18'
+echo '(* 4294967296 4294967296)' | test '1.84467e+19'
+echo '(- (- 0 9223372036854775807) 2)' | test '-9.22337e+18'
+echo '99999999999999999999' | test '1e+20'
+echo '1e400' | test 'inf'
+echo '(- 1e400)' | test '-inf'
+echo '1e-400' | test '0'
+
+# eq? compares identity and equal? structure.  With --hash-cons, equal
+# constants are one list.
+echo "(eq? 'a 'a)" | test '1'
+echo "(define xs '(1 2)) (eq? xs xs)" | test '1'
+echo "(eq? (list 1 2) (list 1 2))" | test '()'
+echo "(equal? (list 1 (list 2.5 'x) 99999999999999999999) '(1 (2.5 x) 99999999999999999999))" |
+    test '1'
+echo "(equal? '(1 (2 . 3)) '(1 (2 . 4)))" | test '()'
+echo "(equal? '$DEEP '$DEEP)" | test '1'
+Q="(eq? '(1 (2 x) . 3) (car '((1 (2 x) . 3))))"
+for ENGINE in '' --vm; do
+    X="$(echo "$Q" | bin/dissemblance $ENGINE | tr '\n' ' ')$(echo "$Q" |
+         bin/dissemblance $ENGINE --hash-cons | tr '\n' ' ')"
+    if ! [ "$X" = '() 1 ' ]; then
+        echo "eq? of equal constants $ENGINE => \"$X\", not \"() 1 \""
+        GOOD=''
+    fi
+done
+
+# Hash tables find keys that are equal?, and stay whole as they grow and shrink.
+echo "(define t (make-hash-table)) (hash-set! t 'a 1) (hash-set! t (list 1 'b) 2)
+      (hash-set! t 99999999999999999999 3) (hash-set! t 'a 4)
+      (list (hash-ref t 'a) (hash-ref t '(1 b)) (hash-ref t 99999999999999999999)
+            (hash-ref t 1.0 'none) (hash-ref t 'c) (hash-count t))" | test '(4 2 3 none () 3)'
+echo "(define t (make-hash-table))
+      (define fill (lambda (n) (if (< 0 n) (begin (hash-set! t n (* n n)) (fill (- n 1))) n)))
+      (define drain (lambda (n) (if (< 0 n) (begin (hash-remove! t n) (drain (- n 2))) n)))
+      (fill 1000) (drain 1000) (hash-remove! t 1000)
+      (list (hash-count t) (hash-ref t 999) (hash-ref t 998))" | test '(500 998001 ())'
+echo "(define t (make-hash-table)) (hash-set! t 1 10) (hash-set! t 2 20) (hash-set! t 3 30)
+      (define n 0) (hash-for-each t (lambda (k v) (set! n (+ n k v))))
+      (hash-remove! t 2) (hash-remove! t 3) (list n (hash-keys t) (hash->list t) t)" |
+    test '(66 (1) ((1 . 10)) #<hash-table 1>)'
+
+# The heap's counts are kept by both engines alike.
+echo '(car (car (heap-stats)))' | test 'conses'
+echo "(define n (heap-stats 'lambdas)) (lambda () 1) (- (heap-stats 'lambdas) n)" | test '1'
+echo "(define g (lambda () 1)) (define n (heap-stats 'frames)) (g) (g) (- (heap-stats 'frames) n)" |
+    test '2'
+echo "(define f (lambda (x) (lambda (y) (lambda (z) (+ x y z))))) (((f 1) 2) 3)
+      (heap-stats 'deepest-frame)" | test '3'
+echo "(<= (heap-stats 'bytes-live) (heap-stats 'peak-bytes-live))" | test '1'
+X="$(echo '(cons 1 2)' | bin/dissemblance --heap-stats 0 2>&1 > /dev/null)"
+case "$X" in
+    'heap: '*' conses, '*' deepest frame 0') ;;
+    *) echo "--heap-stats => \"$X\""; GOOD='' ;;
+esac
+
+# Served scripts each define in an environment of their own, and their
+# output comes back in order.
+SCRIPTS="$(mktemp -d)"
+for N in 1 2 3 4 5 6 7 8; do
+    echo "(define n $N) (define f (lambda (k) (if (< k 2) k (+ (f (- k 1)) (f (- k 2))))))
+          (f (* n 3))" > "$SCRIPTS/$N.scm"
+done
+for ENGINE in '' --vm; do
+    X="$(bin/dissemblance --serve --threads 3 $ENGINE "$SCRIPTS"/*.scm 2> /dev/null |
+         grep -v '()' | tr '\n' ' ')"
+    if ! [ "$X" = '2 8 34 144 610 2584 10946 46368 ' ]; then
+        echo "--serve $ENGINE => \"$X\""
+        GOOD=''
+    fi
+done
+rm -r "$SCRIPTS"
+X="$(printf '7\n(+ 1 2)12\n(define x 4)9\n(* 2 3 4)' | bin/dissemblance --serve 2> /dev/null |
+     tr '\n' ' ')"
+if ! [ "$X" = '2 3 3 () 3 24 ' ]; then
+    echo "--serve from stdin => \"$X\""
+    GOOD=''
+fi
+# A script's own define of a builtin's name shadows it, even for a lambda
+# that has already called the builtin.
+echo "(define f (lambda () (car '(1 2)))) (f) (define car cdr) (f)" > "$PROGRAM"
+for ENGINE in '' --vm; do
+    X="$(bin/dissemblance --serve $ENGINE "$PROGRAM" 2> /dev/null | tail -n 1)"
+    if ! [ "$X" = '(2)' ]; then
+        echo "--serve $ENGINE shadowing car => \"$X\""
+        GOOD=''
+    fi
+done
+
+# An image holds closures, the frames they share, and every kind of value.
+IMAGE="$(mktemp)"
+echo "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+      (define counter ((lambda (n) (lambda () (begin (set! n (+ n 1)) n))) 0))
+      (counter)
+      (define xs '(1 (2.5 x) 99999999999999999999))
+      (define v (vector 1 2 3))
+      (define h (make-hash-table))
+      (hash-set! h xs v)" > "$PROGRAM"
+bin/dissemblance --save-image "$IMAGE" "$PROGRAM" > /dev/null
+for ENGINE in '' --vm; do
+    X="$(echo "(fib 15) (counter) (counter) xs (vector-sum v) (define y 2) y
+               (eq? v (hash-ref h '(1 (2.5 x) 99999999999999999999)))" |
+         bin/dissemblance --image "$IMAGE" $ENGINE | tr '\n' ' ')"
+    if ! [ "$X" = '610 2 3 (1 (2.5 x) 1e+20) 6 () 2 1 ' ]; then
+        echo "--image $ENGINE => \"$X\""
+        GOOD=''
+    fi
+done
+# One cut short, or with a builtin this build does not have, is not loaded.
+echo '(define vr vector-ref)' > "$PROGRAM"
+bin/dissemblance --save-image "$IMAGE" "$PROGRAM" > /dev/null
+SIZE=$(wc -c < "$IMAGE")
+head -c $((SIZE / 16 * 8)) "$IMAGE" > "$PROGRAM"
+X="$(echo 1 | bin/dissemblance --image "$PROGRAM" 2>&1)"
+if ! [ $? = 1 ] || ! [ "$X" = "$PROGRAM: Invalid argument" ]; then
+    echo "--image of half an image => \"$X\""
+    GOOD=''
+fi
+sed 's/vector-ref/vector-rex/' "$IMAGE" > "$PROGRAM"
+X="$(echo 1 | bin/dissemblance --image "$PROGRAM" 2>&1)"
+if ! [ $? = 1 ] || ! [ "$X" = "$PROGRAM: Invalid argument" ]; then
+    echo "--image with an unknown builtin => \"$X\""
+    GOOD=''
+fi
+# Nor is one with a reference past the end of its lambda's frame: the
+# reference to g, in slot 6, moved to slot 7.
+echo '(define f (lambda (a b c d e f g) g))' > "$PROGRAM"
+bin/dissemblance --save-image "$IMAGE" "$PROGRAM" > /dev/null
+WORD=$(od -An -v -tu8 -w8 "$IMAGE" |
+       awk '{ w[NR] = $1 } END { for (i = 1; i < NR; i++) if (w[i] == 2 && w[i + 2] == 0 && w[i + 3] == 6) print i + 2 }')
+cp "$IMAGE" "$PROGRAM"
+printf '\007' | dd of="$PROGRAM" bs=1 seek=$((WORD * 8)) conv=notrunc 2> /dev/null
+X="$(echo '(f 1 2 3 4 5 6 7)' | bin/dissemblance --image "$PROGRAM" 2>&1)"
+if ! [ $? = 1 ] || ! [ "$X" = "$PROGRAM: Invalid argument" ]; then
+    echo "--image with a reference out of its frame => \"$X\""
+    GOOD=''
+fi
+rm "$IMAGE"
+
+# A cached parse gives the same program back, and one of changed text is not
+# used.
+CACHE="$(mktemp -d)"
+echo "(define xs '(1 (2 . 3) -2.5 140737488355328 -9223372036854775808 . x))
+      xs (cdr '$DEEP)" > "$PROGRAM"
+EXPECTED='() (1 (2 . 3) -2.5 140737488355328 -9223372036854775808 . x) () '
+for RUN in cold warm; do
+    X="$(DISSEMBLANCE_CACHE="$CACHE" bin/dissemblance "$PROGRAM" | tr '\n' ' ')"
+    if ! [ "$X" = "$EXPECTED" ] || ! [ -s "$CACHE"/*.fasl ]; then
+        echo "DISSEMBLANCE_CACHE ($RUN) => \"$X\""
+        GOOD=''
+    fi
+done
+echo '(+ 1 2)' > "$PROGRAM"
+X="$(DISSEMBLANCE_CACHE="$CACHE" bin/dissemblance --vm "$PROGRAM")"
+if ! [ "$X" = 3 ]; then
+    echo "DISSEMBLANCE_CACHE after a change => \"$X\""
+    GOOD=''
+fi
+rm -r "$CACHE"
+
+# Lambdas compiled ahead of time give the same results as interpreted ones.
+LIBRARY="$(mktemp -d)"
+echo "(define count (lambda (n total) (if (= n 0) total (count (- n 1) (+ total n)))))
+      (define pair (lambda (a b) (begin (- a) (cons (* a 1.5) (cons (- b) '())))))
+      (define big (lambda (n) (* n 4294967296 4294967296)))
+      (define second (lambda (list) (car (cdr list))))
+      (define odd (lambda (n) (if (<= n 0) () (even (- n 1)))))
+      (define even (lambda (n) (if (<= n 0) 1 (odd (- n 1)))))" > "$LIBRARY/library.scm"
+CALLS="(count 100000 0) (pair 2 3) (big 3) (second '(1 2 3)) (odd 7) (even 7) (map big '(1 2))"
+EXPECTED="$( (cat "$LIBRARY/library.scm"; echo "$CALLS") | bin/dissemblance | tail -n +7 |
+            tr '\n' ' ')"
+rm -f bin/aot/library bin/aot/library.cpp
+make -s LIBRARIES="$LIBRARY" bin/aot/library
+for ENGINE in '' --vm; do
+    X="$(echo "$CALLS" | bin/aot/library $ENGINE | tr '\n' ' ')"
+    if ! [ "$X" = "$EXPECTED" ]; then
+        echo "dissemblance-aot $ENGINE => \"$X\", not \"$EXPECTED\""
+        GOOD=''
+    fi
+done
+echo "(define f (lambda (x) (g x)))" > "$LIBRARY/library.scm"
+if bin/dissemblance-aot "$LIBRARY/library.scm" > /dev/null 2>&1; then
+    echo "dissemblance-aot compiled a call of an unknown procedure"
+    GOOD=''
+fi
+rm -r "$LIBRARY" bin/aot/library bin/aot/library.cpp
+
+# The profiler counts the calls of each lambda, by the name it was defined as.
+for ENGINE in '' --vm; do
+    X="$(echo '(define fib
+                 (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+               (fib 10)' |
+         bin/dissemblance $ENGINE --profile 2>&1 > /dev/null |
+         awk '$4 == "fib" { print $1; exit }')"
+    if ! [ "$X" = 177 ]; then
+        echo "--profile $ENGINE counted $X calls of fib, not 177"
+        GOOD=''
+    fi
+    # One only set! to a variable keeps no name.
+    X="$(echo '(define f (lambda () (define g 0) (set! g (lambda () 1)) (g) (g))) (f)' |
+         bin/dissemblance $ENGINE --profile 2>&1 > /dev/null |
+         awk '$1 == 2 && $4 != "" { print $4 " " $5; exit }')"
+    if ! [ "$X" = '(lambda ())' ]; then
+        echo "--profile $ENGINE named a lambda set! to g \"$X\", not \"(lambda ())\""
+        GOOD=''
+    fi
+done
+
+if [ "$GOOD" ] && ! [ -e "$FAILED" ]; then
     echo good
 else
     echo BAD
+    exit 1
 fi